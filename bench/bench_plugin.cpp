@@ -0,0 +1,43 @@
+// -*- mode:c++ -*-
+//
+// Module bench_plugin.cpp
+//
+// Shared object loaded by the plugin workload (plugin_host.cpp)
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/12   rmg     File creation
+//
+
+#include "workloads.hpp"
+
+namespace plugin
+{
+    long transform(long value)
+    {
+        return (value * 7) ^ (value >> 3);
+    }
+
+    const api functions{transform};
+}
+
+extern "C" const plugin::api* bench_plugin_api()
+{
+    return &plugin::functions;
+}
@@ -0,0 +1,196 @@
+// -*- mode:c++ -*-
+//
+// Header file bench_support.hpp
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/08   rmg     File creation
+// 2020/09/12   rmg     Add run_workload
+// 2020/09/13   rmg     Add cycle_counter and flush_caches
+// 2020/09/25   rmg     Print the workload checksum
+//
+
+#ifndef bench_support_rmg_20200908_included
+#define bench_support_rmg_20200908_included
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+// As in the tests, this stops ahead-of-time inlining so that DRTI has
+// a chain of decorated calls to work with
+#define NOT_INLINED __attribute__((noinline))
+
+namespace drti_bench
+{
+    //! Elapsed wall-clock time since construction
+    class timer
+    {
+    public:
+        timer() : m_start(std::chrono::steady_clock::now()) { }
+
+        double nanoseconds() const
+        {
+            return std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now() - m_start).count();
+        }
+
+    private:
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+    //! Counts elapsed reference cycles with the time stamp counter
+    //! and, if the kernel allows it, actual core cycles for this
+    //! thread via perf_event_open
+    class cycle_counter
+    {
+    public:
+        struct sample
+        {
+            uint64_t tsc;
+            uint64_t core;
+        };
+
+        cycle_counter()
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            m_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+
+        ~cycle_counter()
+        {
+            if(m_fd >= 0)
+            {
+                close(m_fd);
+            }
+        }
+
+        cycle_counter(const cycle_counter&) = delete;
+        cycle_counter& operator=(const cycle_counter&) = delete;
+
+        bool has_core_cycles() const
+        {
+            return m_fd >= 0;
+        }
+
+        sample read() const
+        {
+            sample result{0, 0};
+            if(m_fd >= 0)
+            {
+                if(::read(m_fd, &result.core, sizeof(result.core)) !=
+                   sizeof(result.core))
+                {
+                    result.core = 0;
+                }
+            }
+            // Stop rdtsc executing ahead of the preceding instructions
+            _mm_lfence();
+            result.tsc = __rdtsc();
+            _mm_lfence();
+            return result;
+        }
+
+    private:
+        int m_fd;
+    };
+
+    //! Evict (most of) the caches by writing over a buffer much
+    //! larger than the last-level cache
+    inline void flush_caches()
+    {
+        static std::vector<char> buffer(64 << 20);
+        for(size_t offset = 0; offset < buffer.size(); offset += 64)
+        {
+            buffer[offset] += 1;
+        }
+        asm volatile("" : : "r"(buffer.data()) : "memory");
+    }
+
+    //! Describes the runtime mode for the benchmark output
+    inline const char* mode()
+    {
+        return getenv("DRTI_CALL_PATCHING") ? "call patching" : "default";
+    }
+
+    inline void report(const char* name, long calls, double nanoseconds)
+    {
+        std::cout
+            << name
+            << " ("
+            << mode()
+            << "): "
+            << (nanoseconds / calls)
+            << " ns per call\n";
+    }
+
+    //! Runs a workload function once to warm up (giving DRTI the
+    //! chance to compile it) and then again with timing, reporting
+    //! the throughput in operations per second. The first program
+    //! argument labels the build variant in the output (e.g. plain,
+    //! lto, drti-decorated or drti-warm). The checksum of the
+    //! workload's results goes in the output for comparing variants,
+    //! rather than into the exit status.
+    inline int run_workload(
+        const char* name,
+        int argc,
+        char* argv[],
+        long warmup,
+        long iterations,
+        //! Returns some data-dependent value to keep the optimiser
+        //! from discarding the work
+        long (*workload)(long iterations))
+    {
+        const char* variant = (argc > 1) ? argv[1] : "default";
+
+        long result = workload(warmup);
+
+        timer timer;
+        result += workload(iterations);
+        double elapsed = timer.nanoseconds();
+
+        std::cout
+            << name
+            << " ("
+            << variant
+            << "): "
+            << (iterations * 1e3 / elapsed)
+            << " million iterations per second (checksum "
+            << result
+            << ")\n";
+
+        return EXIT_SUCCESS;
+    }
+}
+
+#endif // bench_support_rmg_20200908_included
@@ -0,0 +1,57 @@
+// -*- mode:c++ -*-
+//
+// Module call_lookup.cpp
+//
+// Exercises the treenode lookup in _drti_call_from directly. This
+// module is compiled without decoration and includes the inline
+// support functions that drti-decorate normally links in.
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/13   rmg     File creation
+//
+
+#include "call_lookup.hpp"
+
+#include <passes/drti-inline.cpp>
+
+drti_bench::call_lookup::call_lookup(int nodes) :
+    m_site{0, m_landing, 0},
+    // The addresses of these bytes serve as distinct targets
+    m_targets(nodes)
+{
+    for(char& target: m_targets)
+    {
+        _drti_lookup_or_insert(m_site, nullptr, &target);
+    }
+}
+
+long drti_bench::call_lookup::calls(long calls)
+{
+    const void* target = &m_targets.back();
+    long sum = 0;
+    for(long count = 0; count < calls; ++count)
+    {
+        // Stop the compiler hoisting the lookup out of the loop
+        asm volatile("" : "+r"(target));
+        sum += reinterpret_cast<intptr_t>(
+            _drti_call_from(m_site, nullptr, target));
+    }
+    return sum;
+}
@@ -0,0 +1,54 @@
+// -*- mode:c++ -*-
+//
+// Header file call_lookup.hpp
+//
+// Exercises the treenode lookup in _drti_call_from directly
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/13   rmg     File creation
+//
+
+#ifndef call_lookup_rmg_20200913_included
+#define call_lookup_rmg_20200913_included
+
+#include <drti/runtime.hpp>
+
+namespace drti_bench
+{
+    //! A static_callsite populated with a given number of root
+    //! treenodes, each for a different (fake) target
+    class call_lookup
+    {
+    public:
+        explicit call_lookup(int nodes);
+
+        //! Calls _drti_call_from the given number of times for the
+        //! most recently added target, which is the worst case for the
+        //! linear search
+        long calls(long calls);
+
+    private:
+        drti::landing_site m_landing;
+        drti::static_callsite m_site;
+        std::vector<char> m_targets;
+    };
+}
+
+#endif // call_lookup_rmg_20200913_included
@@ -0,0 +1,202 @@
+// -*- mode:c++ -*-
+//
+// Module call_overhead.cpp
+//
+// Measures the cycles per call added by the DRTI decorations. Run
+// with DRTI_COMPILE=0 so the decorated chains stay as they are.
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/13   rmg     File creation
+//
+
+#include "bench_support.hpp"
+#include "call_lookup.hpp"
+
+#include <iomanip>
+
+// Only the decorated_* functions and the *_calls functions that call
+// them are listed in drti_bench_targets.txt
+
+NOT_INLINED long plain_leaf(long value)
+{
+    return value + 1;
+}
+
+NOT_INLINED long decorated_leaf(long value)
+{
+    return value + 1;
+}
+
+//! Undecorated caller and callee
+NOT_INLINED long undecorated_calls(long calls)
+{
+    long sum = 0;
+    for(long count = 0; count < calls; ++count)
+    {
+        sum += plain_leaf(count);
+    }
+    return sum;
+}
+
+//! Undecorated caller, so the callee's landing prologue finds no
+//! magic value at the return address
+NOT_INLINED long landing_calls(long calls)
+{
+    long sum = 0;
+    for(long count = 0; count < calls; ++count)
+    {
+        sum += decorated_leaf(count);
+    }
+    return sum;
+}
+
+//! Decorated caller, called from undecorated code so it has no
+//! treenode of its own
+NOT_INLINED long root_calls(long calls)
+{
+    long sum = 0;
+    for(long count = 0; count < calls; ++count)
+    {
+        sum += decorated_leaf(count);
+    }
+    return sum;
+}
+
+//! Decorated caller with a treenode from context_root
+NOT_INLINED long context_calls(long calls)
+{
+    long sum = 0;
+    for(long count = 0; count < calls; ++count)
+    {
+        sum += decorated_leaf(count);
+    }
+    return sum;
+}
+
+NOT_INLINED long context_root(long calls)
+{
+    return context_calls(calls);
+}
+
+namespace
+{
+    constexpr long warm_calls = 10000000;
+    constexpr int cold_samples = 200;
+
+    drti_bench::cycle_counter counter;
+
+    //! Keeps the optimiser from discarding the calls
+    volatile long sink;
+
+    //! Cycles per call with the caches warm
+    template<typename Calls>
+    void measure_warm(const char* name, Calls&& calls)
+    {
+        long sum = calls(1000);
+
+        auto start = counter.read();
+        sum += calls(warm_calls);
+        auto end = counter.read();
+
+        std::cout
+            << std::left << std::setw(28) << name
+            << " warm: "
+            << std::setw(8) << double(end.tsc - start.tsc) / warm_calls
+            << " tsc";
+        if(counter.has_core_cycles())
+        {
+            std::cout
+                << "  "
+                << std::setw(8) << double(end.core - start.core) / warm_calls
+                << " core";
+        }
+        std::cout << " cycles per call\n";
+        sink = sum;
+    }
+
+    //! Average cycles for a single call after evicting the
+    //! caches. This includes the cost of the enclosing *_calls
+    //! function and the counter reads, so compare against the
+    //! undecorated figure.
+    template<typename Calls>
+    void measure_cold(const char* name, Calls&& calls)
+    {
+        uint64_t tsc = 0;
+        uint64_t core = 0;
+        long sum = 0;
+
+        for(int sample = 0; sample < cold_samples; ++sample)
+        {
+            drti_bench::flush_caches();
+            auto start = counter.read();
+            sum += calls(1);
+            auto end = counter.read();
+            tsc += end.tsc - start.tsc;
+            core += end.core - start.core;
+        }
+
+        std::cout
+            << std::left << std::setw(28) << name
+            << " cold: "
+            << std::setw(8) << double(tsc) / cold_samples
+            << " tsc";
+        if(counter.has_core_cycles())
+        {
+            std::cout
+                << "  "
+                << std::setw(8) << double(core) / cold_samples
+                << " core";
+        }
+        std::cout << " cycles per call\n";
+        sink = sum;
+    }
+
+    template<typename Calls>
+    void measure(const char* name, Calls&& calls)
+    {
+        measure_warm(name, calls);
+        measure_cold(name, calls);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if(!counter.has_core_cycles())
+    {
+        std::cout << "perf_event_open unavailable, reporting tsc only\n";
+    }
+
+    measure("undecorated", undecorated_calls);
+    measure("landing prologue only", landing_calls);
+    measure("decorated, no context", root_calls);
+    measure("decorated, with context", context_root);
+
+    for(int nodes: {1, 2, 4, 8, 16, 32})
+    {
+        drti_bench::call_lookup lookup(nodes);
+        std::string name(
+            "_drti_call_from, " + std::to_string(nodes) + " nodes");
+        measure(name.c_str(), [&lookup](long calls) {
+            return lookup.calls(calls);
+        });
+    }
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+// -*- mode:c++ -*-
+//
+// Module call_patching.cpp
+//
+// Measures the per-call cost of a decorated call to a runtime
+// compiled function, with and without DRTI_CALL_PATCHING
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/08   rmg     File creation
+//
+
+#include "bench_support.hpp"
+
+// The chain patched_outer -> patched_middle -> patched_leaf results
+// in patched_middle being recompiled with patched_leaf inlined. The
+// call from patched_outer to patched_middle is direct, so with
+// DRTI_CALL_PATCHING it becomes a "call rel32" to the compiled code
+// instead of an indirect call via treenode::resolved_target.
+
+NOT_INLINED int patched_leaf(int value)
+{
+    return value * 3 + 1;
+}
+
+NOT_INLINED int patched_middle(int value)
+{
+    return patched_leaf(value);
+}
+
+NOT_INLINED int patched_outer(int iterations)
+{
+    int sum = 0;
+    for(int count = 0; count < iterations; ++count)
+    {
+        sum += patched_middle(count);
+    }
+    return sum;
+}
+
+int main(int argc, char *argv[])
+{
+    constexpr int warmup = 1000;
+    constexpr int iterations = 50000000;
+
+    // Discover the chain and compile it
+    int sum = patched_outer(warmup);
+
+    drti_bench::timer timer;
+    sum += patched_outer(iterations);
+    drti_bench::report("call_patching", iterations, timer.nanoseconds());
+
+    // Prevent the whole thing being optimised away
+    return sum == 42 ? 1 : 0;
+}
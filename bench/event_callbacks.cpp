@@ -0,0 +1,59 @@
+// -*- mode:c++ -*-
+//
+// Module event_callbacks.cpp
+//
+// Callbacks for the event loop workload
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/12   rmg     File creation
+//
+
+#include "workloads.hpp"
+
+namespace event_loop
+{
+    long on_tick(const event& next, long state)
+    {
+        return state + 1;
+    }
+
+    long on_data(const event& next, long state)
+    {
+        return state ^ next.payload;
+    }
+
+    long on_timer(const event& next, long state)
+    {
+        return state * 3;
+    }
+
+    long on_close(const event& next, long state)
+    {
+        return 0;
+    }
+
+    void register_callbacks(loop& events)
+    {
+        events.callbacks[0] = on_tick;
+        events.callbacks[1] = on_data;
+        events.callbacks[2] = on_timer;
+        events.callbacks[3] = on_close;
+    }
+}
@@ -0,0 +1,65 @@
+// -*- mode:c++ -*-
+//
+// Module event_loop.cpp
+//
+// Event loop workload: events dispatched to registered callbacks
+// via function pointers
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/12   rmg     File creation
+//
+
+#include "bench_support.hpp"
+#include "workloads.hpp"
+
+using namespace event_loop;
+
+// Chain: pump -> dispatch -> loop::callbacks[kind]
+
+NOT_INLINED long dispatch(loop& events, const event& next)
+{
+    events.state = events.callbacks[next.kind](next, events.state);
+    return events.state;
+}
+
+NOT_INLINED long pump(long iterations)
+{
+    static loop events = []() {
+        loop result{};
+        register_callbacks(result);
+        return result;
+    }();
+
+    long sum = 0;
+    for(long count = 0; count < iterations; ++count)
+    {
+        // Mostly one kind of event, with the occasional other one
+        event next{(count % 16) ? 0 : int(count / 16 % loop::kinds), count};
+        sum += dispatch(events, next);
+    }
+    return sum;
+}
+
+int main(int argc, char *argv[])
+{
+    // One iteration dispatches one event
+    return drti_bench::run_workload(
+        "event_loop", argc, argv, 1000, 50000000, pump);
+}
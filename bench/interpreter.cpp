@@ -0,0 +1,73 @@
+// -*- mode:c++ -*-
+//
+// Module interpreter.cpp
+//
+// Bytecode interpreter workload: a dispatch loop calling opcode
+// handlers via a table of function pointers
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/12   rmg     File creation
+//
+
+#include "bench_support.hpp"
+#include "workloads.hpp"
+
+using namespace interpreter;
+
+// Chain: execute -> run -> handlers[op]
+
+NOT_INLINED long run(machine& vm, const instruction* program, int length)
+{
+    for(int pc = 0; pc < length; ++pc)
+    {
+        handlers[program[pc].op](vm, program[pc].operand);
+    }
+    return vm.accumulator;
+}
+
+NOT_INLINED long execute(long iterations)
+{
+    static const instruction program[] = {
+        { op_load, 1 },
+        { op_add, 3 },
+        { op_multiply, 5 },
+        { op_xor, 0x55 },
+        { op_add, 7 },
+        { op_multiply, 3 },
+        { op_xor, 0xaa },
+        { op_add, 11 },
+    };
+    constexpr int length = sizeof(program) / sizeof(program[0]);
+
+    machine vm{0};
+    long sum = 0;
+    for(long count = 0; count < iterations; ++count)
+    {
+        sum += run(vm, program, length);
+    }
+    return sum;
+}
+
+int main(int argc, char *argv[])
+{
+    // One iteration runs the whole program
+    return drti_bench::run_workload(
+        "interpreter", argc, argv, 1000, 20000000, execute);
+}
@@ -0,0 +1,58 @@
+// -*- mode:c++ -*-
+//
+// Module interpreter_ops.cpp
+//
+// Opcode handlers for the bytecode interpreter workload
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/12   rmg     File creation
+//
+
+#include "workloads.hpp"
+
+namespace interpreter
+{
+    void op_load_handler(machine& vm, long operand)
+    {
+        vm.accumulator = operand;
+    }
+
+    void op_add_handler(machine& vm, long operand)
+    {
+        vm.accumulator += operand;
+    }
+
+    void op_multiply_handler(machine& vm, long operand)
+    {
+        vm.accumulator *= operand;
+    }
+
+    void op_xor_handler(machine& vm, long operand)
+    {
+        vm.accumulator ^= operand;
+    }
+
+    const handler handlers[op_count] = {
+        op_load_handler,
+        op_add_handler,
+        op_multiply_handler,
+        op_xor_handler,
+    };
+}
@@ -0,0 +1,41 @@
+// -*- mode:c++ -*-
+//
+// Module kernel_ops.cpp
+//
+// The loop kernel for the kernels workload
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/18   rmg     File creation
+//
+
+#include "workloads.hpp"
+
+namespace kernels
+{
+    long weighted_sum(const int* data, int count, int stride, int weight)
+    {
+        long sum = 0;
+        for(int index = 0; index < count; ++index)
+        {
+            sum += data[index * stride] * weight;
+        }
+        return sum;
+    }
+}
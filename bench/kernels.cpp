@@ -0,0 +1,99 @@
+// -*- mode:c++ -*-
+//
+// Module kernels.cpp
+//
+// Loop kernel workload: a weighted sum called once with constant
+// arguments and once with arguments only known at run time, to show
+// when re-optimising the inlined kernel (DRTI_REOPTIMIZE) pays off
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/18   rmg     File creation
+//
+
+#include "bench_support.hpp"
+#include "workloads.hpp"
+
+using namespace kernels;
+
+// Chains: execute_fixed -> sum_fixed -> weighted_sum
+//         execute_variable -> sum_variable -> weighted_sum
+
+namespace
+{
+    constexpr int data_size = 4096;
+    int data[data_size];
+}
+
+// Externally visible and set in main, so that nothing is known
+// about them ahead of time
+int variable_count;
+int variable_stride;
+
+NOT_INLINED long sum_fixed(const int* block)
+{
+    // The kernel only sees these constants after runtime inlining,
+    // when a re-optimisation can fully unroll and vectorise it
+    return weighted_sum(block, 16, 1, 3);
+}
+
+NOT_INLINED long execute_fixed(long iterations)
+{
+    long sum = 0;
+    for(long count = 0; count < iterations; ++count)
+    {
+        sum += sum_fixed(data + (count & 1023));
+    }
+    return sum;
+}
+
+NOT_INLINED long sum_variable(const int* block)
+{
+    // Nothing to learn from inlining here, so any gain comes from
+    // the host instruction set alone (DRTI_HOST_ISA)
+    return weighted_sum(block, variable_count, variable_stride, 3);
+}
+
+NOT_INLINED long execute_variable(long iterations)
+{
+    long sum = 0;
+    for(long count = 0; count < iterations; ++count)
+    {
+        sum += sum_variable(data + (count & 1023));
+    }
+    return sum;
+}
+
+int main(int argc, char *argv[])
+{
+    for(int index = 0; index < data_size; ++index)
+    {
+        data[index] = index % 7;
+    }
+    variable_count = 1024;
+    variable_stride = 1;
+
+    // Warm up past drti::hot_chain_calls so that DRTI_HOST_ISA
+    // retargeting happens before timing
+    int status = drti_bench::run_workload(
+        "kernels-fixed", argc, argv, 20000, 20000000, execute_fixed);
+
+    return status + drti_bench::run_workload(
+        "kernels-variable", argc, argv, 20000, 1000000, execute_variable);
+}
@@ -0,0 +1,91 @@
+// -*- mode:c++ -*-
+//
+// Module plugin_host.cpp
+//
+// Plugin workload: calls into a dynamically loaded shared object
+// via its table of function pointers
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/12   rmg     File creation
+//
+
+#include "bench_support.hpp"
+#include "workloads.hpp"
+
+#include <dlfcn.h>
+
+using namespace plugin;
+
+namespace
+{
+    const api& load_plugin(const char* path)
+    {
+        void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+        if(!handle)
+        {
+            std::cerr << "plugin_host: " << dlerror() << "\n";
+            exit(1);
+        }
+
+        auto entry = reinterpret_cast<entry_point>(
+            dlsym(handle, entry_point_name));
+        if(!entry)
+        {
+            std::cerr << "plugin_host: " << dlerror() << "\n";
+            exit(1);
+        }
+
+        return *entry();
+    }
+
+    const api* loaded = nullptr;
+}
+
+// Chain: apply -> call_plugin -> api::transform (in the plugin)
+
+NOT_INLINED long call_plugin(const api& functions, long value)
+{
+    return functions.transform(value);
+}
+
+NOT_INLINED long apply(long iterations)
+{
+    long sum = 0;
+    for(long count = 0; count < iterations; ++count)
+    {
+        sum += call_plugin(*loaded, count);
+    }
+    return sum;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 3)
+    {
+        std::cerr << "usage: plugin_host variant plugin.so\n";
+        return 1;
+    }
+
+    loaded = &load_plugin(argv[2]);
+
+    // One iteration makes one call into the plugin
+    return drti_bench::run_workload(
+        "plugin", argc, argv, 1000, 50000000, apply);
+}
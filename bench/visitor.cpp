@@ -0,0 +1,69 @@
+// -*- mode:c++ -*-
+//
+// Module visitor.cpp
+//
+// Virtual visitor workload: recursive evaluation of an expression
+// tree via virtual function calls
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/12   rmg     File creation
+//
+
+#include "bench_support.hpp"
+#include "workloads.hpp"
+
+using namespace visitor;
+
+namespace
+{
+    constexpr int depth = 6;
+
+    const expression& tree()
+    {
+        static const std::unique_ptr<expression> root(build_tree(depth));
+        return *root;
+    }
+}
+
+// Chain: evaluate_trees -> evaluate_root -> expression::evaluate
+// (which then recurses via further virtual calls)
+
+NOT_INLINED long evaluate_root(const expression* root)
+{
+    return root->evaluate();
+}
+
+NOT_INLINED long evaluate_trees(long iterations)
+{
+    const expression* root = &tree();
+    long sum = 0;
+    for(long count = 0; count < iterations; ++count)
+    {
+        sum += evaluate_root(root);
+    }
+    return sum;
+}
+
+int main(int argc, char *argv[])
+{
+    // One iteration evaluates the whole tree
+    return drti_bench::run_workload(
+        "visitor", argc, argv, 1000, 2000000, evaluate_trees);
+}
@@ -0,0 +1,98 @@
+// -*- mode:c++ -*-
+//
+// Module visitor_nodes.cpp
+//
+// Expression node classes for the virtual visitor workload
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/12   rmg     File creation
+//
+
+#include "workloads.hpp"
+
+namespace visitor
+{
+    struct literal : expression
+    {
+        explicit literal(long value) : m_value(value) { }
+
+        long evaluate() const override
+        {
+            return m_value;
+        }
+
+        long m_value;
+    };
+
+    struct binary : expression
+    {
+        binary(std::unique_ptr<expression> left,
+               std::unique_ptr<expression> right) :
+            m_left(std::move(left)),
+            m_right(std::move(right))
+        {
+        }
+
+        std::unique_ptr<expression> m_left;
+        std::unique_ptr<expression> m_right;
+    };
+
+    struct add : binary
+    {
+        using binary::binary;
+
+        long evaluate() const override
+        {
+            return m_left->evaluate() + m_right->evaluate();
+        }
+    };
+
+    struct multiply : binary
+    {
+        using binary::binary;
+
+        long evaluate() const override
+        {
+            return m_left->evaluate() * m_right->evaluate();
+        }
+    };
+
+    std::unique_ptr<expression> build_tree(int depth)
+    {
+        if(depth == 0)
+        {
+            return std::make_unique<literal>(3);
+        }
+        else if(depth % 2)
+        {
+            return std::make_unique<add>(
+                build_tree(depth - 1), build_tree(depth - 1));
+        }
+        else
+        {
+            return std::make_unique<multiply>(
+                build_tree(depth - 1), build_tree(depth - 1));
+        }
+    }
+}
+
+DRTI_CONVERTIBLE(visitor::expression*, visitor::literal*);
+DRTI_CONVERTIBLE(visitor::expression*, visitor::add*);
+DRTI_CONVERTIBLE(visitor::expression*, visitor::multiply*);
@@ -0,0 +1,149 @@
+// -*- mode:c++ -*-
+//
+// Header file workloads.hpp
+//
+// Declarations shared by the two halves of each workload benchmark.
+// Each workload is split across compilation units (or a shared
+// object) so that plain AOT compilation can't inline across the
+// interesting calls, leaving that to LTO or DRTI
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/12   rmg     File creation
+// 2020/09/18   rmg     Add kernels
+//
+
+#ifndef workloads_rmg_20200912_included
+#define workloads_rmg_20200912_included
+
+#include <drti/convertible.hpp>
+
+#include <memory>
+
+// The *type_matched_* functions make sure their types appear in the
+// calling modules, so drti-decorate recognises calls via pointers of
+// these types (see drti_bench_targets.txt and tests/test_support.hpp)
+
+namespace interpreter
+{
+    //! Accumulator machine, which keeps the handlers trivial so the
+    //! dispatch overhead dominates
+    struct machine
+    {
+        long accumulator;
+    };
+
+    enum opcode : unsigned char
+    {
+        op_load,
+        op_add,
+        op_multiply,
+        op_xor,
+        op_count
+    };
+
+    struct instruction
+    {
+        opcode op;
+        long operand;
+    };
+
+    using handler = void (*)(machine&, long operand);
+
+    //! Indexed by opcode (interpreter_ops.cpp)
+    extern const handler handlers[op_count];
+
+    __attribute__((used)) inline void type_matched_handler(machine&, long)
+    {
+    }
+}
+
+namespace visitor
+{
+    struct expression
+    {
+        virtual ~expression() = default;
+        virtual long evaluate() const = 0;
+    };
+
+    //! Builds a complete binary tree of additions and multiplications
+    //! over literal leaves (visitor_nodes.cpp)
+    std::unique_ptr<expression> build_tree(int depth);
+
+    __attribute__((used)) inline long type_matched_evaluate(
+        const expression*)
+    {
+        return 0;
+    }
+}
+
+namespace event_loop
+{
+    struct event
+    {
+        int kind;
+        long payload;
+    };
+
+    using callback = long (*)(const event&, long state);
+
+    struct loop
+    {
+        static constexpr int kinds = 4;
+        callback callbacks[kinds];
+        long state;
+    };
+
+    //! Installs one callback per event kind (event_callbacks.cpp)
+    void register_callbacks(loop&);
+
+    __attribute__((used)) inline long type_matched_callback(
+        const event&, long)
+    {
+        return 0;
+    }
+}
+
+namespace plugin
+{
+    struct api
+    {
+        long (*transform)(long);
+    };
+
+    using entry_point = const api* (*)();
+
+    //! Looked up via dlsym in the loaded plugin (bench_plugin.cpp)
+    constexpr const char* entry_point_name = "bench_plugin_api";
+
+    __attribute__((used)) inline long type_matched_transform(long)
+    {
+        return 0;
+    }
+}
+
+namespace kernels
+{
+    //! Weighted sum of count elements of data, stride apart. The
+    //! loop is a candidate for vectorisation and unrolling, which
+    //! profit from knowing the arguments (kernel_ops.cpp)
+    long weighted_sum(const int* data, int count, int stride, int weight);
+}
+
+#endif // workloads_rmg_20200912_included
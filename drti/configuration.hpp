@@ -21,6 +21,13 @@
 // History
 // =======
 // 2019/10/28   rmg     File creation
+// 2020/09/22   rmg     Version 2 for landing_site::patchable_entry
+// 2020/09/22   rmg     Version 3 for the static_callsite patching fields
+// 2020/09/22   rmg     Version 4 for treenode::profile
+// 2020/09/22   rmg     Version 5 for the landing_site branch counts
+// 2020/09/22   rmg     Version 6 for the reflect side file fields
+// 2020/09/22   rmg     Version 7 for the treenode timing fields
+// 2020/09/24   rmg     Version 8 for landing_site::entry
 //
 
 #ifndef configuration_rmg_20191028_included
@@ -30,12 +37,41 @@
 // as macros
 #define DRTI_RETALIGN 32
 #define DRTI_STASH_BYTES 8
-#define DRTI_VERSION 1
+// Bytes reserved after the stash at each decorated call site for
+// rewriting it into a direct call. The first byte holds the distance
+// back to the jump over the stash and the rest is space for a "call
+// rel32; jmp rel8" sequence written at runtime.
+#define DRTI_PATCH_BYTES 8
+// Change this along with the layout of the structures in runtime.hpp
+// or the signatures of the inline support functions, so that the
+// runtime rejects (and the landing prologue ignores) modules
+// decorated by an older pass
+#define DRTI_VERSION 8
 #define DRTI_MAGIC (0xd511 + (DRTI_VERSION << 16))
+// Bytes of prefix data before a patchable function entry point. This
+// holds an 8-byte absolute address followed by an indirect jump
+// through it, which the runtime activates by overwriting the first
+// two bytes of the function with a short jump backwards.
+#define DRTI_ENTRY_PREFIX_BYTES 16
 
 namespace drti
 {
   constexpr int housekeeping_interval = 1000;
+  //! Number of argument values to record at a profiled call site
+  //! before compiling the call chain
+  constexpr int value_profile_samples = 1000;
+  //! Number of calls along one call chain before the runtime hears
+  //! about it as a hot chain (see hot_treenode)
+  constexpr int hot_chain_calls = 10000;
+  //! A timed call site (see DRTI_TIME_CALLS) measures one call in
+  //! this many along each chain
+  constexpr int timing_interval = 64;
+  //! Estimated TSC cycles spent along one timed call chain before
+  //! the runtime compiles it, in place of hot_chain_calls
+  constexpr int64_t hot_chain_cycles = 50000000;
+  //! Mean TSC cycles per call along a timed chain above which the
+  //! call overhead that inlining would save is negligible
+  constexpr int64_t negligible_call_cycles = 1000000;
 }
 
 #endif // configuration_rmg_20191028_included
@@ -0,0 +1,45 @@
+// -*- mode:c++ -*-
+//
+// Header file convertible.hpp
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// DRTI is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/12   rmg     File creation from tests/test_support.hpp
+//
+
+#ifndef convertible_rmg_20200912_included
+#define convertible_rmg_20200912_included
+
+//! Generate a support function to allow DRTI to convert between
+//! (pointer) types at runtime. This is necessary to make virtual
+//! function calls work, since during inlining a call to (e.g.) void
+//! virtual_function(base*) actually resolves to void
+//! virtual_function(derived*). This is really just a workaround; to
+//! make this work properly we would want the C++ front-end to provide
+//! something equivalent to this.
+#define DRTI_CONVERTIBLE(SOURCE_TYPE, TARGET_TYPE)     \
+    __attribute__((used, always_inline)) static inline \
+    TARGET_TYPE __drti_converter(                      \
+        /* Dummy argument makes overloading work */    \
+        SOURCE_TYPE value, TARGET_TYPE /* dummy */)    \
+    {                                                  \
+        return static_cast<TARGET_TYPE>(value);        \
+    }
+
+#endif // convertible_rmg_20200912_included
@@ -23,12 +23,15 @@
 // 2020/01/17   rmg     File creation
 // 2020/04/19   rmg     File deleted (unused)
 // 2020/08/03   rmg     File restored to centralise global variable filtering
+// 2020/09/18   rmg     Add visit_conditional_branches
 //
 
 #include "drti-common.hpp"
 
-#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
 #include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
 
 void drti::visit_listed_globals(
     llvm::Module& module,
@@ -61,3 +64,19 @@ void drti::visit_listed_globals(
         }
     }
 }
+
+void drti::visit_conditional_branches(
+    llvm::Function& function,
+    const std::function<void(llvm::BranchInst&)>& callback)
+{
+    for(llvm::BasicBlock& block: function)
+    {
+        auto branch = llvm::dyn_cast_or_null<llvm::BranchInst>(
+            block.getTerminator());
+
+        if(branch && branch->isConditional())
+        {
+            callback(*branch);
+        }
+    }
+}
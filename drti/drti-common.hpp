@@ -23,6 +23,7 @@
 // 2020/01/17   rmg     File creation
 // 2020/04/19   rmg     File deleted (unused)
 // 2020/08/03   rmg     File restored to centralise global variable filtering
+// 2020/09/18   rmg     Add visit_conditional_branches
 //
 
 #ifndef drti_common_rmg_20200117_included
@@ -32,6 +33,8 @@
 
 namespace llvm
 {
+    class BranchInst;
+    class Function;
     class Module;
     class GlobalVariable;
 }
@@ -43,6 +46,13 @@ namespace drti
     void visit_listed_globals(
         llvm::Module&,
         const std::function<void(llvm::GlobalVariable&)>&);
+
+    //! Visit the conditional branches of a function in a fixed order,
+    //! which numbers them for branch profiling (see
+    //! landing_site::branch_counts)
+    void visit_conditional_branches(
+        llvm::Function&,
+        const std::function<void(llvm::BranchInst&)>&);
 }
 
 #endif // drti_common_rmg_20200117_included
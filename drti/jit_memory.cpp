@@ -0,0 +1,344 @@
+// -*- mode:c++ -*-
+//
+// Module jit_memory.cpp
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// DRTI is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/21   rmg     File creation
+// 2020/09/22   rmg     Huge page code region with affinity arenas
+// 2020/09/24   rmg     Start new roots in the tail of the latest arena
+// 2020/09/25   rmg     Give each root its own arena again
+//
+
+#include "jit_memory.hpp"
+
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Support/Memory.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <system_error>
+#include <utility>
+
+#include <link.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace
+{
+    //! Address space reserved for JIT code and data. It costs nothing
+    //! until used, apart from the address range.
+    constexpr size_t heap_bytes = size_t(256) << 20;
+    //! The first part of the heap holds only code, so that it stays
+    //! dense and can be backed by huge pages. The rest holds data.
+    constexpr size_t code_bytes = heap_bytes / 2;
+    //! Space to leave in each region for one compilation before we
+    //! stop handing out the heap
+    constexpr size_t compilation_bytes = size_t(8) << 20;
+    //! Code for the same chain root is allocated sequentially from an
+    //! arena of (at least) this size, and a root that runs out of
+    //! room gets a fresh one. Roots never share an arena, since a
+    //! root taking over the rest of another's would scatter that
+    //! root's later compilations. The code half still has room for
+    //! thousands of roots.
+    constexpr size_t arena_bytes = size_t(64) << 10;
+    //! Maximum distance for a rel32 displacement, less some slack
+    //! for the offset of the displacement within an instruction
+    constexpr intptr_t rel32_reach = (intptr_t(1) << 31) - 4096;
+    //! Huge page size, which we align the heap to for the sake of
+    //! the kernel's transparent huge pages
+    constexpr uintptr_t heap_alignment = uintptr_t(2) << 20;
+
+    //! A pair of bump allocators for JIT memory in a range reserved
+    //! near the main program, one for code and one for data. Nothing
+    //! is ever freed, since the compiled code lives as long as the
+    //! process anyway.
+    class jit_heap
+    {
+    public:
+        jit_heap();
+
+        bool available();
+        bool reaches(const void* address) const;
+
+        //! Allocate whole pages, for code if the purpose says so and
+        //! otherwise for data. Code with the same affinity key goes
+        //! into the same arena while it has room, in allocation order
+        //! (see arena_bytes).
+        llvm::sys::MemoryBlock allocate(
+            llvm::SectionMemoryManager::AllocationPurpose purpose,
+            size_t bytes,
+            const void* affinity,
+            unsigned flags,
+            std::error_code& error);
+
+    private:
+        struct arena
+        {
+            char* next;
+            char* end;
+        };
+
+        char* take(char*& next, char* end, size_t bytes);
+
+        std::mutex m_mutex;
+        char* m_base = nullptr;
+        char* m_next_code = nullptr;
+        char* m_next_data = nullptr;
+        char* m_end = nullptr;
+        std::map<const void*, arena> m_arenas;
+    };
+
+    jit_heap& the_heap()
+    {
+        static jit_heap heap;
+        return heap;
+    }
+
+    //! The mapper for one compilation, which supplies its affinity
+    //! key to the heap
+    class affinity_mapper : public llvm::SectionMemoryManager::MemoryMapper
+    {
+    public:
+        explicit affinity_mapper(const void* affinity) :
+            m_affinity(affinity)
+        {
+        }
+
+        llvm::sys::MemoryBlock allocateMappedMemory(
+            llvm::SectionMemoryManager::AllocationPurpose purpose,
+            size_t bytes,
+            const llvm::sys::MemoryBlock* const,
+            unsigned flags,
+            std::error_code& error) override
+        {
+            return the_heap().allocate(
+                purpose, bytes, m_affinity, flags, error);
+        }
+
+        std::error_code protectMappedMemory(
+            const llvm::sys::MemoryBlock& block, unsigned flags) override
+        {
+            return llvm::sys::Memory::protectMappedMemory(block, flags);
+        }
+
+        std::error_code releaseMappedMemory(llvm::sys::MemoryBlock&) override
+        {
+            return std::error_code();
+        }
+
+    private:
+        const void* const m_affinity;
+    };
+
+    //! SectionMemoryManager only keeps a pointer to its mapper, and
+    //! uses it from its destructor, so the mapper lives in an earlier
+    //! base class
+    struct mapper_holder
+    {
+        explicit mapper_holder(const void* affinity) : m_mapper(affinity) { }
+
+        affinity_mapper m_mapper;
+    };
+
+    class jit_heap_manager :
+        private mapper_holder,
+        public llvm::SectionMemoryManager
+    {
+    public:
+        explicit jit_heap_manager(const void* affinity) :
+            mapper_holder(affinity),
+            llvm::SectionMemoryManager(&m_mapper)
+        {
+        }
+    };
+
+    //! The address range of the main program's loadable segments
+    std::pair<uintptr_t, uintptr_t> main_program_bounds()
+    {
+        std::pair<uintptr_t, uintptr_t> bounds(UINTPTR_MAX, 0);
+
+        dl_iterate_phdr(
+            [](dl_phdr_info* info, size_t, void* data) {
+                auto& bounds = *static_cast<std::pair<uintptr_t, uintptr_t>*>(data);
+                for(int index = 0; index < info->dlpi_phnum; ++index)
+                {
+                    const ElfW(Phdr)& header(info->dlpi_phdr[index]);
+                    if(header.p_type == PT_LOAD)
+                    {
+                        uintptr_t start = info->dlpi_addr + header.p_vaddr;
+                        bounds.first = std::min(bounds.first, start);
+                        bounds.second = std::max(
+                            bounds.second, start + header.p_memsz);
+                    }
+                }
+                // The main program always comes first
+                return 1;
+            },
+            &bounds);
+
+        return bounds;
+    }
+}
+
+jit_heap::jit_heap()
+{
+    auto [low, high] = main_program_bounds();
+    if(low >= high)
+    {
+        return;
+    }
+
+    // Below the program, since the brk heap grows upwards from its
+    // end. The kernel treats the address as a hint and can put the
+    // mapping anywhere, so check where it actually ended up.
+    uintptr_t hint = (low - heap_bytes) & ~(heap_alignment - 1);
+
+    for(int attempt = 0; attempt < 8 && hint > heap_bytes; ++attempt)
+    {
+        void* mapped = mmap(
+            reinterpret_cast<void*>(hint), heap_bytes, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if(mapped == MAP_FAILED)
+        {
+            return;
+        }
+
+        m_base = static_cast<char*>(mapped);
+        m_end = m_base + heap_bytes;
+
+        if(reaches(reinterpret_cast<void*>(low)) &&
+           reaches(reinterpret_cast<void*>(high)))
+        {
+            m_next_code = m_base;
+            m_next_data = m_base + code_bytes;
+            // Transparent huge pages for the code, when the system
+            // allows it (the "madvise" setting or better). The kernel
+            // can only collapse a huge page once all of it has the
+            // same protection, which happens as compilations get
+            // finalized, so hot chains compiled early benefit most.
+            // The flag is advisory and failure doesn't matter.
+            madvise(m_base, code_bytes, MADV_HUGEPAGE);
+            return;
+        }
+
+        munmap(mapped, heap_bytes);
+        m_base = m_end = nullptr;
+        hint -= heap_bytes;
+    }
+}
+
+bool jit_heap::available()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_base &&
+        (size_t(m_base + code_bytes - m_next_code) >= compilation_bytes) &&
+        (size_t(m_end - m_next_data) >= compilation_bytes);
+}
+
+bool jit_heap::reaches(const void* address) const
+{
+    const intptr_t target = reinterpret_cast<intptr_t>(address);
+    return m_base &&
+        (std::abs(target - reinterpret_cast<intptr_t>(m_base)) < rel32_reach) &&
+        (std::abs(target - reinterpret_cast<intptr_t>(m_end)) < rel32_reach);
+}
+
+char* jit_heap::take(char*& next, char* end, size_t bytes)
+{
+    if(size_t(end - next) < bytes)
+    {
+        return nullptr;
+    }
+
+    char* start = next;
+    next += bytes;
+    return start;
+}
+
+llvm::sys::MemoryBlock jit_heap::allocate(
+    llvm::SectionMemoryManager::AllocationPurpose purpose,
+    size_t bytes,
+    const void* affinity,
+    unsigned flags,
+    std::error_code& error)
+{
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    bytes = (bytes + page_size - 1) & ~(page_size - 1);
+
+    char* start = nullptr;
+
+    if(m_base)
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+
+        if(purpose == llvm::SectionMemoryManager::AllocationPurpose::Code)
+        {
+            // Pages are never shared between compilations, since
+            // finalizing one makes its pages read-only
+            arena& current(m_arenas[affinity]);
+            start = take(current.next, current.end, bytes);
+
+            if(!start)
+            {
+                size_t size = std::max(bytes, arena_bytes);
+                char* fresh = take(m_next_code, m_base + code_bytes, size);
+                if(fresh)
+                {
+                    current = arena{fresh + bytes, fresh + size};
+                    start = fresh;
+                }
+            }
+        }
+        else
+        {
+            start = take(m_next_data, m_end, bytes);
+        }
+    }
+
+    if(!start)
+    {
+        error = std::make_error_code(std::errc::not_enough_memory);
+        return llvm::sys::MemoryBlock();
+    }
+
+    llvm::sys::MemoryBlock block(start, bytes);
+    error = llvm::sys::Memory::protectMappedMemory(block, flags);
+    return block;
+}
+
+bool drti::jit_heap_available()
+{
+    return the_heap().available();
+}
+
+std::unique_ptr<llvm::RuntimeDyld::MemoryManager> drti::jit_heap_memory_manager(
+    const void* affinity)
+{
+    return std::make_unique<jit_heap_manager>(affinity);
+}
+
+bool drti::jit_heap_reaches(const void* address)
+{
+    return the_heap().reaches(address);
+}
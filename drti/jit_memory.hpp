@@ -0,0 +1,56 @@
+// -*- mode:c++ -*-
+//
+// Header file jit_memory.hpp
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// DRTI is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/21   rmg     File creation
+// 2020/09/22   rmg     Add affinity key
+//
+
+#ifndef jit_memory_rmg_20200921_included
+#define jit_memory_rmg_20200921_included
+
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+
+#include <memory>
+
+namespace drti
+{
+    //! Check whether the JIT heap, which is reserved (on first use)
+    //! within rel32 range of the main program, is available and has
+    //! room for another compilation. If not, JIT code has to use the
+    //! large code model with the default memory manager.
+    bool jit_heap_available();
+
+    //! A memory manager for one compilation, allocating code and data
+    //! from the JIT heap. Code goes in a region of its own, advised
+    //! for transparent huge pages, and code for compilations with the
+    //! same affinity key (e.g. the root of a call chain) is placed
+    //! consecutively where possible.
+    std::unique_ptr<llvm::RuntimeDyld::MemoryManager> jit_heap_memory_manager(
+        const void* affinity);
+
+    //! Whether every address in the JIT heap can reach the given one
+    //! with a 32-bit displacement, so that code compiled with the
+    //! small code model can call or address it directly
+    bool jit_heap_reaches(const void* address);
+}
+
+#endif // jit_memory_rmg_20200921_included
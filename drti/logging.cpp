@@ -0,0 +1,426 @@
+// -*- mode:c++ -*-
+//
+// Module logging.cpp
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// DRTI is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/17   rmg     File creation
+// 2020/09/24   rmg     Don't drop errors or trace and debug output
+// 2020/09/25   rmg     Never block the logging thread, at any level
+//
+
+#include "logging.hpp"
+
+#include <drti/runtime.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <streambuf>
+#include <thread>
+
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace
+{
+    const char* const level_names[] = {
+        "fatal", "error", "warn", "info", "trace", "debug" };
+
+    int initial_log_level()
+    {
+        const char* value = std::getenv("DRTI_LOG_LEVEL");
+        return value ? std::atoi(value) : drti::log_level::warn;
+    }
+
+    std::atomic<int>& log_threshold()
+    {
+        static std::atomic<int> threshold(initial_log_level());
+        return threshold;
+    }
+
+    //! One line (or part of a long line) of log output. Each slot
+    //! carries a sequence number for the bounded MPSC queue
+    //! algorithm (after Dmitry Vyukov's bounded MPMC queue).
+    struct log_record
+    {
+        static constexpr size_t text_size = 96;
+
+        std::atomic<size_t> sequence;
+        int64_t timestamp_ns;
+        pid_t thread;
+        int16_t level;
+        //! Set if the text continues in the next record from the
+        //! same thread
+        bool partial;
+        uint8_t length;
+        char text[text_size];
+    };
+
+    class log_ring
+    {
+    public:
+        static constexpr size_t capacity = 4096;
+
+        log_ring();
+        ~log_ring();
+
+        //! Queue a record. If the ring is full, returns false and
+        //! counts the record as dropped, whatever its level, so that
+        //! the logging thread never waits for the drain thread.
+        bool push(
+            int level, pid_t thread, bool partial,
+            const char* text, size_t length);
+
+        void flush();
+
+    private:
+        static_assert((capacity & (capacity - 1)) == 0, "power of two");
+
+        void start_drain();
+        void drain_loop();
+        void drain();
+        void write(const log_record&, std::ostream&);
+
+        log_record m_slots[capacity];
+        alignas(64) std::atomic<size_t> m_enqueue;
+        alignas(64) size_t m_dequeue = 0;
+        std::atomic<size_t> m_written;
+        std::atomic<size_t> m_dropped;
+        std::atomic<bool> m_stop;
+        std::atomic<bool> m_draining;
+        std::once_flag m_started;
+        std::thread m_drain_thread;
+        // Drain-thread state for joining partial records
+        pid_t m_partial_thread = 0;
+    };
+
+    log_ring& the_ring()
+    {
+        static log_ring ring;
+        return ring;
+    }
+
+    pid_t this_thread_id()
+    {
+        static thread_local pid_t id = syscall(SYS_gettid);
+        return id;
+    }
+
+    //! Collects output from one thread until a newline or flush,
+    //! then passes it to the ring in record-sized pieces
+    class line_buffer : public std::streambuf
+    {
+    public:
+        line_buffer()
+        {
+            setp(m_buffer, m_buffer + sizeof(m_buffer));
+        }
+
+        ~line_buffer()
+        {
+            sync();
+        }
+
+        int m_level = drti::log_level::info;
+
+    protected:
+        int_type overflow(int_type c) override
+        {
+            publish(true);
+            if(!traits_type::eq_int_type(c, traits_type::eof()))
+            {
+                sputc(traits_type::to_char_type(c));
+            }
+            return traits_type::not_eof(c);
+        }
+
+        std::streamsize xsputn(const char* text, std::streamsize count) override
+        {
+            std::streamsize done = 0;
+            while(done < count)
+            {
+                const char* newline = static_cast<const char*>(
+                    std::memchr(text + done, '\n', count - done));
+                std::streamsize end = newline ? (newline - text) + 1 : count;
+
+                while(done < end)
+                {
+                    std::streamsize chunk = std::min<std::streamsize>(
+                        end - done, epptr() - pptr());
+                    std::memcpy(pptr(), text + done, chunk);
+                    pbump(chunk);
+                    done += chunk;
+                    if(pptr() == epptr() && done < end)
+                    {
+                        publish(true);
+                    }
+                }
+
+                if(newline)
+                {
+                    publish(false);
+                }
+            }
+            return count;
+        }
+
+        int sync() override
+        {
+            if(pptr() != pbase())
+            {
+                publish(false);
+            }
+            return 0;
+        }
+
+    private:
+        void publish(bool partial)
+        {
+            size_t length = pptr() - pbase();
+            if(!partial && length && m_buffer[length - 1] == '\n')
+            {
+                --length;
+            }
+            the_ring().push(m_level, this_thread_id(), partial, m_buffer, length);
+            setp(m_buffer, m_buffer + sizeof(m_buffer));
+        }
+
+        char m_buffer[log_record::text_size];
+    };
+
+    struct thread_log
+    {
+        thread_log() : stream(&buffer) { }
+
+        line_buffer buffer;
+        std::ostream stream;
+    };
+
+    thread_log& this_thread_log()
+    {
+        static thread_local thread_log log;
+        return log;
+    }
+}
+
+log_ring::log_ring() :
+    m_enqueue(0),
+    m_written(0),
+    m_dropped(0),
+    m_stop(false),
+    m_draining(false)
+{
+    for(size_t index = 0; index < capacity; ++index)
+    {
+        m_slots[index].sequence.store(index, std::memory_order_relaxed);
+    }
+}
+
+log_ring::~log_ring()
+{
+    m_stop.store(true);
+    if(m_drain_thread.joinable())
+    {
+        m_drain_thread.join();
+    }
+    m_draining.store(false);
+    drain();
+}
+
+bool log_ring::push(
+    int level, pid_t thread, bool partial, const char* text, size_t length)
+{
+    std::call_once(m_started, &log_ring::start_drain, this);
+
+    size_t position = m_enqueue.load(std::memory_order_relaxed);
+    log_record* slot;
+
+    while(true)
+    {
+        slot = &m_slots[position & (capacity - 1)];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        intptr_t difference =
+            static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+        if(difference == 0)
+        {
+            if(m_enqueue.compare_exchange_weak(
+                   position, position + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(difference < 0)
+        {
+            // Full - the drain thread hasn't released this slot yet
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        else
+        {
+            position = m_enqueue.load(std::memory_order_relaxed);
+        }
+    }
+
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    slot->timestamp_ns = int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+    slot->thread = thread;
+    slot->level = level;
+    slot->partial = partial;
+    slot->length = std::min(length, log_record::text_size);
+    std::memcpy(slot->text, text, slot->length);
+    slot->sequence.store(position + 1, std::memory_order_release);
+
+    return true;
+}
+
+void log_ring::start_drain()
+{
+    m_drain_thread = std::thread(&log_ring::drain_loop, this);
+    m_draining.store(true, std::memory_order_release);
+}
+
+void log_ring::drain_loop()
+{
+    while(!m_stop.load(std::memory_order_relaxed))
+    {
+        drain();
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+}
+
+void log_ring::drain()
+{
+    std::ostringstream output;
+
+    while(true)
+    {
+        log_record& slot = m_slots[m_dequeue & (capacity - 1)];
+        if(slot.sequence.load(std::memory_order_acquire) != m_dequeue + 1)
+        {
+            break;
+        }
+
+        write(slot, output);
+        slot.sequence.store(m_dequeue + capacity, std::memory_order_release);
+        ++m_dequeue;
+    }
+
+    size_t dropped = m_dropped.exchange(0, std::memory_order_relaxed);
+    if(dropped)
+    {
+        if(m_partial_thread)
+        {
+            output << "\n";
+            m_partial_thread = 0;
+        }
+        output << "DRTI log ring full, dropped " << dropped << " records\n";
+    }
+
+    const std::string& text = output.str();
+    if(!text.empty())
+    {
+        std::cerr.write(text.data(), text.size());
+        std::cerr.flush();
+    }
+
+    m_written.store(m_dequeue, std::memory_order_release);
+}
+
+void log_ring::write(const log_record& record, std::ostream& output)
+{
+    if(m_partial_thread && m_partial_thread != record.thread)
+    {
+        output << "\n";
+        m_partial_thread = 0;
+    }
+
+    if(!m_partial_thread)
+    {
+        int level = record.level;
+        output
+            << record.timestamp_ns / 1000000000 << "."
+            << std::setw(6) << std::setfill('0')
+            << (record.timestamp_ns % 1000000000) / 1000
+            << " " << record.thread << " "
+            << ((level >= 0 && level <= drti::log_level::debug)
+                ? level_names[level] : "?")
+            << " ";
+    }
+
+    output.write(record.text, record.length);
+
+    if(record.partial)
+    {
+        m_partial_thread = record.thread;
+    }
+    else
+    {
+        output << "\n";
+        m_partial_thread = 0;
+    }
+}
+
+void log_ring::flush()
+{
+    size_t target = m_enqueue.load(std::memory_order_acquire);
+    while(m_draining.load(std::memory_order_acquire) &&
+          m_written.load(std::memory_order_acquire) < target)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+bool drti::log_enabled(int level)
+{
+    if(level <= log_threshold().load(std::memory_order_relaxed))
+    {
+        this_thread_log().buffer.m_level = level;
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+}
+
+std::ostream& drti::log_stream()
+{
+    return this_thread_log().stream;
+}
+
+void drti::flush_log()
+{
+    log_stream().flush();
+    the_ring().flush();
+}
+
+int drti::set_log_level(int level)
+{
+    return log_threshold().exchange(level);
+}
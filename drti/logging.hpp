@@ -0,0 +1,55 @@
+// -*- mode:c++ -*-
+//
+// Header file logging.hpp
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// DRTI is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/17   rmg     File creation
+// 2020/09/24   rmg     Document which levels are never dropped
+//
+
+#ifndef logging_rmg_20200917_included
+#define logging_rmg_20200917_included
+
+#include <ostream>
+
+namespace drti
+{
+    enum log_level : int { fatal, error, warn, info, trace, debug };
+
+    //! Check whether messages at the given level are currently
+    //! wanted. If so, the level is remembered for the calling
+    //! thread's subsequent output to log_stream(). The threshold
+    //! comes from DRTI_LOG_LEVEL (default warn) and can be changed
+    //! at any time with set_log_level.
+    bool log_enabled(int level);
+
+    //! A per-thread stream whose complete lines are queued as
+    //! records (timestamp, thread id, level, text) in a lock-free
+    //! ring buffer. A background thread drains the ring to stderr,
+    //! and the ring's destructor drains whatever is left at exit.
+    //! Lines that don't fit in the ring are dropped and counted,
+    //! whatever their level, so logging never blocks.
+    std::ostream& log_stream();
+
+    //! Wait until everything logged so far has been written out
+    void flush_log();
+}
+
+#endif // logging_rmg_20200917_included
@@ -0,0 +1,454 @@
+// -*- mode:c++ -*-
+//
+// Module patching.cpp
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// DRTI is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/07   rmg     File creation
+// 2020/09/15   rmg     Add resolve_plt
+// 2020/09/20   rmg     Add resolve_thunk
+//
+
+#include "patching.hpp"
+
+#include <drti/runtime.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <mutex>
+
+#include <linux/membarrier.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+    std::mutex& patch_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    //! Temporarily make a range of (executable) text writable as well
+    class writable_text
+    {
+    public:
+        writable_text(void* start, size_t size);
+        ~writable_text();
+
+        bool ok() const { return m_ok; }
+
+    private:
+        void* m_pages;
+        size_t m_size;
+        bool m_ok;
+    };
+
+    writable_text::writable_text(void* start, size_t size)
+    {
+        const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        const uintptr_t first = reinterpret_cast<uintptr_t>(start);
+        const uintptr_t begin = first & ~(page_size - 1);
+        const uintptr_t end =
+            (first + size + page_size - 1) & ~(page_size - 1);
+
+        m_pages = reinterpret_cast<void*>(begin);
+        m_size = end - begin;
+
+        // Other threads may be executing code from the same pages so
+        // they must remain executable throughout
+        m_ok = mprotect(
+            m_pages, m_size, PROT_READ | PROT_WRITE | PROT_EXEC) == 0;
+    }
+
+    writable_text::~writable_text()
+    {
+        if(m_ok)
+        {
+            mprotect(m_pages, m_size, PROT_READ | PROT_EXEC);
+        }
+    }
+
+    //! Make sure that every thread in the process executes a
+    //! serializing instruction before it next executes any modified
+    //! code, as required for cross-modifying code on x86
+    void serialize_cores()
+    {
+        static const bool registered = syscall(
+            __NR_membarrier,
+            MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0) == 0;
+
+        if(registered &&
+           syscall(
+               __NR_membarrier,
+               MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0) == 0)
+        {
+            return;
+        }
+
+        // Older kernels - revoking write permission from a page that
+        // we've just written forces a TLB shootdown, which
+        // interrupts every other core running one of our threads
+        static void* page = mmap(
+            nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if(page != MAP_FAILED)
+        {
+            mprotect(page, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE);
+            *static_cast<volatile char*>(page) = 0;
+            mprotect(page, sysconf(_SC_PAGESIZE), PROT_READ);
+        }
+    }
+
+    //! The absolute address slot at the start of the prefix data
+    const void** entry_slot(void* entry)
+    {
+        return reinterpret_cast<const void**>(
+            static_cast<char*>(entry) - DRTI_ENTRY_PREFIX_BYTES);
+    }
+
+    //! The patchable entry point itself, which the landing site
+    //! might only know via a PLT stub
+    char* real_entry(const drti::landing_site& landing)
+    {
+        return static_cast<char*>(
+            const_cast<void*>(drti::resolve_plt(landing.patchable_entry)));
+    }
+
+    //! Skip an endbr64 instruction (from -fcf-protection)
+    const uint8_t* skip_endbr(const uint8_t* code)
+    {
+        const uint8_t endbr64[] = { 0xf3, 0x0f, 0x1e, 0xfa };
+        return memcmp(code, endbr64, sizeof(endbr64)) ? code : code + 4;
+    }
+}
+
+bool drti::entry_patched(const landing_site& landing)
+{
+    return landing.patchable_entry &&
+        __atomic_load_n(entry_slot(real_entry(landing)), __ATOMIC_ACQUIRE);
+}
+
+bool drti::patch_entry(landing_site& landing, const void* target)
+{
+    if(!landing.patchable_entry)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(patch_mutex());
+
+    if(entry_patched(landing))
+    {
+        return false;
+    }
+
+    char* entry = real_entry(landing);
+
+    writable_text text(
+        entry - DRTI_ENTRY_PREFIX_BYTES, DRTI_ENTRY_PREFIX_BYTES + 2);
+
+    if(!text.ok())
+    {
+        return false;
+    }
+
+    // The prefix is never executed until the entry point is patched,
+    // so it's safe to update the jump target first
+    __atomic_store_n(entry_slot(entry), target, __ATOMIC_RELEASE);
+    serialize_cores();
+
+    // Then replace the first instruction with "jmp entry-8" (EB F6)
+    // which lands on the indirect jump in the prefix. The decorate
+    // pass aligned the entry point so this is a single atomic store
+    // and concurrent callers see either the old or the new
+    // instruction.
+    const uint8_t short_jump[2] = { 0xeb, 0xf6 };
+    uint16_t value;
+    static_assert(sizeof(value) == sizeof(short_jump));
+    __builtin_memcpy(&value, short_jump, sizeof(value));
+    __atomic_store_n(
+        reinterpret_cast<uint16_t*>(entry), value, __ATOMIC_SEQ_CST);
+
+    __builtin___clear_cache(entry, entry + 2);
+
+    return true;
+}
+
+bool drti::patch_call(static_callsite& callsite, const void* target)
+{
+    if(!callsite.fixed_target || !callsite.return_address)
+    {
+        return false;
+    }
+
+    // Every decorated call site looks like this (see insertInlineAsm
+    // in drti-target.cpp) where only the JMP and the CALL get
+    // executed:
+    //
+    //   jump:   jmp pre
+    //           .align DRTI_RETALIGN
+    //   stash:  .8byte DRTI_MAGIC
+    //   patch:  .byte stash - jump
+    //           int3 x (DRTI_PATCH_BYTES - 1)
+    //           nop padding
+    //   pre:    call *resolved_target
+    //   post:   (aligned return address)
+    //
+    // We write "call rel32; jmp post" into the (unreachable) patch
+    // area, make sure all cores will see it and then redirect the
+    // initial jmp with a single byte store. Concurrent callers
+    // therefore execute either the old or the new sequence in its
+    // entirety. The return address differs for the direct call but
+    // the callee is JIT-compiled code, which doesn't look for the
+    // magic value.
+    static_assert(DRTI_PATCH_BYTES >= 8, "Patch area too small");
+
+    uint8_t* post = static_cast<uint8_t*>(
+        const_cast<void*>(callsite.return_address));
+    uint8_t* stash = post - DRTI_RETALIGN;
+    uint8_t* patch = stash + DRTI_STASH_BYTES;
+    uint8_t* call = patch + 1;
+    uint8_t* jump = stash - patch[0];
+
+    uint64_t magic;
+    std::memcpy(&magic, stash, sizeof(magic));
+
+    if(magic != DRTI_MAGIC || jump[0] != 0xeb)
+    {
+        return false;
+    }
+
+    const ptrdiff_t call_displacement =
+        static_cast<const uint8_t*>(target) - (call + 5);
+    const ptrdiff_t jump_displacement = call - (jump + 2);
+
+    if(call_displacement < std::numeric_limits<int32_t>::min() ||
+       call_displacement > std::numeric_limits<int32_t>::max() ||
+       jump_displacement > std::numeric_limits<int8_t>::max())
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(patch_mutex());
+
+    if(static_cast<int8_t>(jump[1]) == jump_displacement)
+    {
+        // Already redirected
+        return false;
+    }
+
+    writable_text text(jump, post - jump);
+
+    if(!text.ok())
+    {
+        return false;
+    }
+
+    const int32_t rel32 = call_displacement;
+    call[0] = 0xe8;
+    std::memcpy(call + 1, &rel32, sizeof(rel32));
+    call[5] = 0xeb;
+    call[6] = static_cast<uint8_t>(post - (call + 7));
+
+    serialize_cores();
+
+    __atomic_store_n(
+        jump + 1, static_cast<uint8_t>(jump_displacement), __ATOMIC_SEQ_CST);
+
+    __builtin___clear_cache(
+        reinterpret_cast<char*>(jump), reinterpret_cast<char*>(post));
+
+    return true;
+}
+
+const void* drti::resolve_plt(const void* address)
+{
+    if(!address)
+    {
+        return address;
+    }
+
+    const uint8_t* function = static_cast<const uint8_t*>(address);
+
+    // Allow for a PLT stub jumping to another, e.g. .plt.sec to .plt
+    for(int hops = 0; hops < 4; ++hops)
+    {
+        const uint8_t* code = skip_endbr(function);
+
+        // Optional MPX "bnd" prefix, as used in .plt.sec
+        if(code[0] == 0xf2)
+        {
+            ++code;
+        }
+
+        // jmp *disp32(%rip)
+        if((code[0] != 0xff) || (code[1] != 0x25))
+        {
+            break;
+        }
+
+        int32_t displacement;
+        memcpy(&displacement, code + 2, sizeof(displacement));
+        const void* const* got_entry = reinterpret_cast<const void* const*>(
+            code + 6 + displacement);
+        const uint8_t* next = static_cast<const uint8_t*>(
+            __atomic_load_n(got_entry, __ATOMIC_ACQUIRE));
+
+        // An unbound lazy PLT entry points back to the push of the
+        // relocation index, either in the same stub or in .plt
+        if(skip_endbr(next)[0] == 0x68)
+        {
+            return address;
+        }
+
+        function = next;
+    }
+
+    return function;
+}
+
+const void* drti::resolve_thunk(const void* address, thunk_adjustment& adjustment)
+{
+    if(!address)
+    {
+        return nullptr;
+    }
+
+    const uint8_t* code = skip_endbr(static_cast<const uint8_t*>(address));
+
+    // Always 64-bit operand size
+    if(code[0] != 0x48)
+    {
+        return nullptr;
+    }
+
+    // The ModRM byte selects the register, rdi (this) or rsi (this
+    // after a hidden struct return pointer)
+    unsigned argument;
+    int64_t offset;
+    const uint8_t* next;
+
+    switch(code[1])
+    {
+    case 0x83:
+    case 0x81:
+    {
+        // add/sub $imm8 or $imm32, %rdi/%rsi
+        bool imm8 = (code[1] == 0x83);
+        switch(code[2])
+        {
+        case 0xc7: // add to %rdi
+        case 0xef: // sub from %rdi
+            argument = 0;
+            break;
+        case 0xc6: // add to %rsi
+        case 0xee: // sub from %rsi
+            argument = 1;
+            break;
+        default:
+            return nullptr;
+        }
+
+        if(imm8)
+        {
+            offset = static_cast<int8_t>(code[3]);
+            next = code + 4;
+        }
+        else
+        {
+            int32_t immediate;
+            memcpy(&immediate, code + 3, sizeof(immediate));
+            offset = immediate;
+            next = code + 7;
+        }
+
+        if((code[2] == 0xef) || (code[2] == 0xee))
+        {
+            offset = -offset;
+        }
+        break;
+    }
+
+    case 0x8d:
+    {
+        // lea disp8(%rdi), %rdi or disp32 (and likewise for %rsi)
+        switch(code[2])
+        {
+        case 0x7f:
+        case 0xbf:
+            argument = 0;
+            break;
+        case 0x76:
+        case 0xb6:
+            argument = 1;
+            break;
+        default:
+            return nullptr;
+        }
+
+        if(code[2] < 0x80)
+        {
+            offset = static_cast<int8_t>(code[3]);
+            next = code + 4;
+        }
+        else
+        {
+            int32_t displacement;
+            memcpy(&displacement, code + 3, sizeof(displacement));
+            offset = displacement;
+            next = code + 7;
+        }
+        break;
+    }
+
+    default:
+        return nullptr;
+    }
+
+    // Followed directly by jmp rel32 or rel8, or an indirect jump
+    // via the GOT (with -fno-plt) which resolve_plt follows
+    const uint8_t* target;
+    if((next[0] == 0xff) && (next[1] == 0x25))
+    {
+        target = next;
+    }
+    else if(next[0] == 0xe9)
+    {
+        int32_t displacement;
+        memcpy(&displacement, next + 1, sizeof(displacement));
+        target = next + 5 + displacement;
+    }
+    else if(next[0] == 0xeb)
+    {
+        target = next + 2 + static_cast<int8_t>(next[1]);
+    }
+    else
+    {
+        return nullptr;
+    }
+
+    adjustment.argument = argument;
+    adjustment.offset = offset;
+
+    return resolve_plt(target);
+}
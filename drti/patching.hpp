@@ -0,0 +1,81 @@
+// -*- mode:c++ -*-
+//
+// Header file patching.hpp
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// DRTI is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/07   rmg     File creation
+// 2020/09/15   rmg     Add resolve_plt
+// 2020/09/20   rmg     Add resolve_thunk
+//
+
+#ifndef patching_rmg_20200907_included
+#define patching_rmg_20200907_included
+
+#include <cstdint>
+
+namespace drti
+{
+    struct landing_site;
+    struct static_callsite;
+
+    //! Check whether the function entry point for the landing site
+    //! has already been redirected
+    bool entry_patched(const landing_site&);
+
+    //! Redirect the entry point of a function decorated with a
+    //! patchable prologue to the given target, so that all callers
+    //! (decorated or not) arrive there instead. Returns false if the
+    //! function isn't patchable or was already redirected.
+    bool patch_entry(landing_site&, const void* target);
+
+    //! Rewrite a decorated call site with a fixed target so that it
+    //! calls the given target directly, bypassing the load of
+    //! treenode::resolved_target and the indirect call. Returns false
+    //! if the call site isn't suitable, the target is out of range or
+    //! the call site was already rewritten.
+    bool patch_call(static_callsite&, const void* target);
+
+    //! Follow PLT stubs and other indirect jumps via the GOT from a
+    //! function address to the function itself. For example, the
+    //! canonical address of a function from a shared library can be
+    //! a PLT stub in a non-PIE executable. Returns the address
+    //! unchanged if it doesn't start with such a jump or the GOT
+    //! entry hasn't been bound yet.
+    const void* resolve_plt(const void* address);
+
+    //! The constant pointer adjustment made by a this-adjusting
+    //! thunk, e.g. for a virtual call via a secondary base class
+    struct thunk_adjustment
+    {
+        //! The adjusted argument, which is 1 rather than 0 (this) if
+        //! the function returns a structure via a hidden pointer
+        unsigned argument = 0;
+        int64_t offset = 0;
+    };
+
+    //! If the address is a thunk that adds a constant to its first
+    //! or second argument register and then jumps to another
+    //! function, return that function (see resolve_plt) and set the
+    //! adjustment. Otherwise return nullptr. Thunks that look up a
+    //! virtual base offset are not recognised.
+    const void* resolve_thunk(const void* address, thunk_adjustment&);
+}
+
+#endif // patching_rmg_20200907_included
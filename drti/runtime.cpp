@@ -23,38 +23,136 @@
 // 2019/11/25   rmg     File creation
 //
 
+#include "llvm/Analysis/AssumptionCache.h"
 #include "llvm/Analysis/InlineCost.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/IR/Constant.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/IRPrintingPasses.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Linker/Linker.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/raw_os_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
 #include <drti/runtime.hpp>
 #include <drti/drti-common.hpp>
-
+#include <drti/jit_memory.hpp>
+#include <drti/logging.hpp>
+#include <drti/patching.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
-
-static std::ostream& log_stream(std::cerr);
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace drti
 {
+    //! Cost threshold for inlining into compiled chains. We like
+    //! inlining a lot, and the normal default is 225.
+    constexpr int inline_threshold = 1000;
+
     struct InternalCompilerError { };
 
-    enum log_level : int { fatal, error, warn, info, trace, debug };
+    //! Thrown when a chain isn't worth compiling (see
+    //! TreenodeCompiler::rejection)
+    struct CompileRejected : InternalCompilerError
+    {
+        std::string reason;
+        //! False if the rejection only follows from the chain's share
+        //! of its call site's calls, which can grow, so that the next
+        //! treenode for the same chain tries again
+        bool lasting = true;
+    };
+
     struct runtime_config
     {
-        int log_level = log_level::info;
+        runtime_config();
+
+        //! Compile chains at all. Turning this off leaves just the
+        //! overhead of the decorations, e.g. for benchmarking
+        bool compile = true;
+        //! Compile chains starting at root treenodes as well, and
+        //! redirect the caller's patchable entry point to the result
+        //! (see DRTI_PATCHABLE_ENTRY in drti-decorate.cpp)
+        bool entry_patching = false;
+        //! Rewrite decorated call sites with a fixed target into
+        //! direct calls once their target has been compiled
+        bool call_patching = false;
+        //! Maximum number of modules, besides those of the caller and
+        //! the leaf, to link in for each compilation
+        int link_modules = 2;
+        //! Recompile the targets of hot chains for the host CPU (and
+        //! compile chains for it too) rather than keeping the
+        //! instruction set they were built for ahead of time
+        bool host_isa = false;
+        //! Re-run the loop optimisations, including vectorisation,
+        //! on compiled code with a host target machine (the leaf is
+        //! otherwise assumed to be optimised already)
+        bool reoptimize = false;
+        //! Put compiled code in the JIT heap near the main program
+        //! and use the small code model (see jit_memory.hpp)
+        bool near_code = true;
+        //! Check whether inlining the leaf is likely to pay off
+        //! before compiling a chain
+        bool inline_check = true;
+    };
+
+    //! Decorated modules registered by their static constructors and
+    //! an index of the (non-local) functions they define
+    class module_registry
+    {
+    public:
+        void add(reflect*);
+
+        //! The registered module that defines the named function, or
+        //! nullptr. Indexes any newly registered modules first, using
+        //! the given context (and the caller must hold its lock).
+        reflect* defining_module(llvm::LLVMContext&, llvm::StringRef name);
+
+    private:
+        void index(llvm::LLVMContext&, reflect&);
+
+        std::mutex m_mutex;
+        std::vector<reflect*> m_modules;
+        //! The number of m_modules already indexed
+        size_t m_indexed = 0;
+        std::unordered_map<std::string, reflect*> m_definitions;
     };
 
     bool abi_ok(int caller_abi);
@@ -62,21 +160,132 @@ namespace drti
     void maybe_log_error(
         const landing_site&, const char* context, const char* message);
     void compile_treenode(treenode* node);
+    void retarget_treenode(treenode* node);
 
     runtime_config config;
 
+    //! Stops two threads compiling the same treenode at the same
+    //! time, e.g. after landing there simultaneously
+    class compile_claim
+    {
+    public:
+        explicit compile_claim(treenode*);
+        ~compile_claim();
+
+        bool claimed() const { return m_claimed; }
+
+    private:
+        static std::mutex s_mutex;
+        static std::unordered_set<treenode*> s_claims;
+
+        treenode* m_node;
+        bool m_claimed;
+    };
+
+    //! Compiled code for a chain depends on the caller's call site and
+    //! the target, but not on how the caller itself was reached, so
+    //! treenodes with different parents can share it. Chains with a
+    //! value profile are specialised on their own samples and don't
+    //! share.
+    class compiled_chains
+    {
+    public:
+        static bool shareable(const treenode&);
+
+        //! Whether a chain matching the treenode has been compiled,
+        //! or failed to compile (leaving the result nullptr). The
+        //! reason is set if it was rejected rather than failing.
+        bool find(const treenode&, void*& result, std::string& reason);
+        void add(
+            const treenode&, void* compiled,
+            const std::string& reason = std::string());
+
+    private:
+        using key = std::pair<const static_callsite*, const void*>;
+
+        struct entry
+        {
+            void* compiled;
+            std::string reason;
+        };
+
+        std::mutex m_mutex;
+        std::map<key, entry> m_compiled;
+    };
+
+    static compiled_chains& chains()
+    {
+        static compiled_chains instance;
+        return instance;
+    }
+
+    static module_registry& registry()
+    {
+        static module_registry instance;
+        return instance;
+    }
+
+    //! The bitcode of a decorated module, mapping its side file on
+    //! first use if it has one (see DRTI_BITCODE_FILE). Empty if the
+    //! side file is missing or doesn't match.
+    llvm::StringRef reflected_bitcode(const reflect&);
+
+    //! Entry counters for compiled code. The bitcode we compile
+    //! predates decoration, so instead of the landing_site accounting
+    //! the compiled code increments a single counter of its own on
+    //! entry, which we add to the total for the landing site it
+    //! stands in for (see landing_total). Like the compiled code,
+    //! the counters are never freed.
+    class entry_counters
+    {
+    public:
+        //! A new counter contributing to the given landing site
+        counter_t& add(const landing_site&);
+        //! Let an existing counter contribute to another landing
+        //! site as well, e.g. the leaf inlined into a compiled chain
+        void share(const landing_site&, counter_t&);
+        int64_t total(const landing_site&);
+        //! A landing site with counters, by function name
+        const landing_site* find(const char* function_name);
+
+    private:
+        std::mutex m_mutex;
+        std::unordered_multimap<const landing_site*, std::unique_ptr<counter_t>>
+            m_counters;
+        std::unordered_multimap<const landing_site*, counter_t*> m_shared;
+    };
+
+    static entry_counters& counters()
+    {
+        static entry_counters instance;
+        return instance;
+    }
+
+    //! Total for weighted_branches
+    static counter_t& weighted_branch_count()
+    {
+        static counter_t instance = 0;
+        return instance;
+    }
+
     struct ReflectedModule
     {
         ReflectedModule(llvm::LLVMContext&, landing_site&);
+        //! For a module without a landing site of its own, using
+        //! the given landing site for error reporting
+        ReflectedModule(llvm::LLVMContext&, landing_site&, reflect&);
+        //! For a landing site in the same module as another, taking
+        //! over ownership of the already-parsed module from it
+        ReflectedModule(landing_site&, ReflectedModule& sibling);
 
         std::unique_ptr<llvm::Module> readModule(llvm::LLVMContext&);
         llvm::Function* callsite_function();
+        //! Map the stored addresses of every global the bitcode
+        //! requires. Some of these may be defined by other modules
+        //! that we link with, see defineGlobals.
         void globalsMap(
             llvm::orc::SymbolMap& map,
-            llvm::orc::MangleAndInterner&,
-            //! Other module to check for function definitions (if we
-            //! have a definition we want to be able to recompile it)
-            llvm::Module& availableModule);
+            llvm::orc::MangleAndInterner&);
 
         landing_site& m_landing_site;
         reflect& m_self;
@@ -91,10 +300,24 @@ namespace drti
         void* compile();
 
     private:
-        std::unique_ptr<llvm::orc::LLJIT> createJit();
+        ReflectedModule callerModule();
+        //! Create the JIT, add the extra modules and collect the
+        //! stored global addresses, once the chain has passed the
+        //! inline check
+        void prepare();
+        void addExtraModules();
         void linkModules();
-        void reprocess(llvm::Function*, ReflectedModule&, const static_callsite&);
+        bool reprocess(llvm::Function*, ReflectedModule&, const static_callsite&);
         void reprocess(llvm::CallBase* callInst, ReflectedModule& leaf);
+        void specialiseDirect(llvm::CallBase* callBase, ReflectedModule& leaf);
+
+        std::vector<std::pair<int64_t, int64_t>> dominantValues() const;
+        llvm::Function* specialise(llvm::Function*, int64_t value);
+        llvm::Value* specialisedCall(
+            llvm::IRBuilder<>& builder,
+            ReflectedModule& leaf,
+            llvm::ArrayRef<llvm::Value*> args,
+            llvm::CallInst* original = nullptr);
 
         llvm::Function* findConverter(
             llvm::Type* fromType, llvm::Type* toType) const;
@@ -110,6 +333,7 @@ namespace drti
             const llvm::Argument& parameter,
             const llvm::Function& function) const;
 
+        std::string rejection(bool& lasting);
         void optimize();
 
         treenode* m_node;
@@ -120,11 +344,295 @@ namespace drti
 
         ReflectedModule m_leaf;
         ReflectedModule m_caller;
+        //! Modules defining functions that the caller or leaf call
+        std::vector<std::unique_ptr<ReflectedModule>> m_extras;
+
+        //! Compiling into the JIT heap with the small code model
+        const bool m_near_code;
+        //! Null until prepare()
+        std::unique_ptr<llvm::orc::LLJIT> m_jit;
+        //! Stored addresses of globals from all the modules, pending
+        //! removal of those we compile ourselves
+        llvm::orc::SymbolMap m_globals_map;
+    };
+
+    //! Recompiles the target of a hot treenode by itself, without
+    //! any inlining, for the host CPU (see runtime_config::host_isa)
+    class RetargetCompiler
+    {
+    public:
+        RetargetCompiler(treenode* node);
+        void* compile();
+
+    private:
+        treenode* m_node;
 
+        llvm::orc::ThreadSafeContext m_thread_safe_context;
+        llvm::orc::ThreadSafeContext::Lock m_lock;
+        llvm::LLVMContext& m_context;
+
+        ReflectedModule m_target;
+        const bool m_near_code;
         std::unique_ptr<llvm::orc::LLJIT> m_jit;
     };
 }
 
+static int env_int(const char* name, int default_value)
+{
+    const char* value = getenv(name);
+    if(value && *value)
+    {
+        return std::atoi(value);
+    }
+    else
+    {
+        return default_value;
+    }
+}
+
+static bool env_flag(const char* name)
+{
+    return env_int(name, 0) != 0;
+}
+
+drti::runtime_config::runtime_config() :
+    compile(env_int("DRTI_COMPILE", 1) != 0),
+    entry_patching(env_flag("DRTI_ENTRY_PATCHING")),
+    call_patching(env_flag("DRTI_CALL_PATCHING")),
+    link_modules(env_int("DRTI_LINK_MODULES", 2)),
+    host_isa(env_flag("DRTI_HOST_ISA")),
+    reoptimize(env_flag("DRTI_REOPTIMIZE")),
+    near_code(env_int("DRTI_NEAR_CODE", 1) != 0),
+    inline_check(env_int("DRTI_INLINE_CHECK", 1) != 0)
+{
+}
+
+//! A relative side file name is relative to the directory of the
+//! binary containing the reflect
+static std::string sideFilePath(const drti::reflect& self)
+{
+    llvm::StringRef name(self.side_file);
+    if(llvm::sys::path::is_absolute(name))
+    {
+        return name.str();
+    }
+
+    std::string binary;
+    Dl_info info;
+    link_map* map = nullptr;
+    if(dladdr1(&self, &info, reinterpret_cast<void**>(&map), RTLD_DL_LINKMAP) &&
+       map)
+    {
+        // The main program has an empty name in the link map
+        binary = *map->l_name ?
+            map->l_name : llvm::sys::fs::getMainExecutable(nullptr, nullptr);
+    }
+
+    llvm::SmallString<256> path(llvm::sys::path::parent_path(binary));
+    llvm::sys::path::append(path, name);
+    return path.str().str();
+}
+
+static llvm::StringRef mapSideFile(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return llvm::StringRef();
+    }
+
+    struct stat status;
+    void* address = MAP_FAILED;
+    if((fstat(fd, &status) == 0) && (status.st_size > 0))
+    {
+        address = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if(address == MAP_FAILED)
+    {
+        return llvm::StringRef();
+    }
+
+    return llvm::StringRef(static_cast<const char*>(address), status.st_size);
+}
+
+//! Side files stay mapped once we've needed them. Processes that
+//! never compile anything don't map them at all, and those that do
+//! share the page cache with any others using the same binary.
+llvm::StringRef drti::reflected_bitcode(const reflect& self)
+{
+    if(!self.side_file)
+    {
+        return llvm::StringRef(self.module, self.module_size);
+    }
+
+    static std::mutex mutex;
+    static std::unordered_map<std::string, llvm::StringRef> mapped_files;
+    // Also remembers failures, as an empty result
+    static std::unordered_map<const reflect*, llvm::StringRef> checked;
+
+    std::lock_guard<std::mutex> guard(mutex);
+
+    auto found = checked.find(&self);
+    if(found != checked.end())
+    {
+        return found->second;
+    }
+
+    llvm::StringRef& result(checked[&self]);
+
+    std::string path(sideFilePath(self));
+    auto file = mapped_files.find(path);
+    if(file == mapped_files.end())
+    {
+        file = mapped_files.emplace(path, mapSideFile(path)).first;
+    }
+
+    const char* problem = nullptr;
+    if(file->second.empty())
+    {
+        problem = "could not be mapped";
+    }
+    else if(self.side_offset + self.module_size > file->second.size())
+    {
+        problem = "is too short";
+    }
+    else
+    {
+        llvm::StringRef bitcode(
+            file->second.substr(self.side_offset, self.module_size));
+
+        if(llvm::xxHash64(bitcode) == self.side_hash)
+        {
+            result = bitcode;
+        }
+        else
+        {
+            problem = "does not match the hash of the module";
+        }
+    }
+
+    if(problem && log_enabled(log_level::error))
+    {
+        log_stream()
+            << "DRTI bitcode side file "
+            << path
+            << " "
+            << problem
+            << "\n";
+    }
+
+    return result;
+}
+
+void drti::module_registry::add(reflect* self)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_modules.push_back(self);
+}
+
+drti::reflect* drti::module_registry::defining_module(
+    llvm::LLVMContext& context, llvm::StringRef name)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+
+    for(; m_indexed < m_modules.size(); ++m_indexed)
+    {
+        index(context, *m_modules[m_indexed]);
+    }
+
+    auto found = m_definitions.find(name.str());
+
+    return (found == m_definitions.end()) ? nullptr : found->second;
+}
+
+void drti::module_registry::index(llvm::LLVMContext& context, reflect& self)
+{
+    // Lazy loading is enough to see which functions have bodies, and
+    // we discard the module straight away (see also the comment in
+    // ReflectedModule::readModule)
+    llvm::MemoryBufferRef buffer(reflected_bitcode(self), "bitcode");
+
+    llvm::Expected<std::unique_ptr<llvm::Module>> maybeModule(
+        llvm::getLazyBitcodeModule(buffer, context));
+
+    if(!maybeModule)
+    {
+        llvm::consumeError(maybeModule.takeError());
+
+        if(log_enabled(log_level::warn))
+        {
+            log_stream() << "DRTI failed to index registered module\n";
+        }
+        return;
+    }
+
+    for(const llvm::Function& function: **maybeModule)
+    {
+        if(!function.isDeclaration() &&
+           !function.hasLocalLinkage() &&
+           !function.hasAvailableExternallyLinkage())
+        {
+            // First definition wins, as for the dynamic linker
+            m_definitions.emplace(function.getName().str(), &self);
+        }
+    }
+}
+
+void drti::register_module(reflect* self)
+{
+    registry().add(self);
+}
+
+std::mutex drti::compile_claim::s_mutex;
+std::unordered_set<drti::treenode*> drti::compile_claim::s_claims;
+
+drti::compile_claim::compile_claim(treenode* node) :
+    m_node(node)
+{
+    std::lock_guard<std::mutex> guard(s_mutex);
+    m_claimed = s_claims.insert(m_node).second;
+}
+
+drti::compile_claim::~compile_claim()
+{
+    if(m_claimed)
+    {
+        std::lock_guard<std::mutex> guard(s_mutex);
+        s_claims.erase(m_node);
+    }
+}
+
+bool drti::compiled_chains::shareable(const treenode& node)
+{
+    return !node.profile.samples;
+}
+
+bool drti::compiled_chains::find(
+    const treenode& node, void*& result, std::string& reason)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto found = m_compiled.find(key(&node.location, node.target));
+    if(found == m_compiled.end())
+    {
+        return false;
+    }
+    result = found->second.compiled;
+    reason = found->second.reason;
+    return true;
+}
+
+void drti::compiled_chains::add(
+    const treenode& node, void* compiled, const std::string& reason)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    // Two threads can compile the same chain via different treenodes,
+    // in which case either result will do
+    m_compiled.emplace(
+        key(&node.location, node.target), entry{compiled, reason});
+}
+
 static int oneTimeInit()
 {
     llvm::InitializeNativeTarget();
@@ -133,12 +641,18 @@ static int oneTimeInit()
     return 0;
 }
 
+//! Each thread that compiles gets a context of its own, so
+//! independent chains compile in parallel rather than queueing for a
+//! single context lock. The JIT keeps a reference to the context of
+//! any module it has compiled, so these outlive their threads as
+//! necessary.
 static llvm::orc::ThreadSafeContext llvmContext()
 {
     using namespace llvm;
     static int dummy = oneTimeInit();
     static_cast<void>(dummy);
-    static orc::ThreadSafeContext tsc(std::make_unique<LLVMContext>());
+    static thread_local orc::ThreadSafeContext tsc(
+        std::make_unique<LLVMContext>());
     return tsc;
 }
 
@@ -146,9 +660,9 @@ bool drti::abi_ok(int caller_abi)
 {
     if(caller_abi != abi_version)
     {
-        if(config.log_level >= log_level::error)
+        if(log_enabled(log_level::error))
         {
-            log_stream
+            log_stream()
                 << "DRTI ABI mismatch client "
                 << caller_abi
                 << " != runtime "
@@ -168,7 +682,7 @@ bool drti::abi_ok(int caller_abi)
     {                                                   \
         llvm::handleAllErrors(                          \
             ERROR,                                      \
-            [this](llvm::ErrorInfoBase& EIB) {          \
+            [&](llvm::ErrorInfoBase& EIB) {             \
                 drti::maybe_log_error(                  \
                     LANDING, CONTEXT,                   \
                     EIB.message().c_str() );            \
@@ -188,15 +702,80 @@ bool drti::abi_ok(int caller_abi)
         HANDLE(LANDING, CONTEXT, std::move(ERROR));     \
     }
 
+drti::counter_t& drti::entry_counters::add(const landing_site& landing)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto inserted = m_counters.emplace(&landing, new counter_t(0));
+    return *inserted->second;
+}
+
+void drti::entry_counters::share(const landing_site& landing, counter_t& counter)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_shared.emplace(&landing, &counter);
+}
+
+int64_t drti::entry_counters::total(const landing_site& landing)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    int64_t result = landing.total_called;
+    auto range = m_counters.equal_range(&landing);
+    for(auto iter = range.first; iter != range.second; ++iter)
+    {
+        result += *iter->second;
+    }
+    auto shared = m_shared.equal_range(&landing);
+    for(auto iter = shared.first; iter != shared.second; ++iter)
+    {
+        result += *iter->second;
+    }
+    return result;
+}
+
+int64_t drti::landing_total(const landing_site& landing)
+{
+    return counters().total(landing);
+}
+
+int64_t drti::weighted_branches()
+{
+    return weighted_branch_count();
+}
+
+const drti::landing_site* drti::entry_counters::find(const char* function_name)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for(const auto& counter: m_counters)
+    {
+        if(!std::strcmp(counter.first->function_name, function_name))
+        {
+            return counter.first;
+        }
+    }
+    for(const auto& counter: m_shared)
+    {
+        if(!std::strcmp(counter.first->function_name, function_name))
+        {
+            return counter.first;
+        }
+    }
+    return nullptr;
+}
+
+const drti::landing_site* drti::counted_landing_site(const char* function_name)
+{
+    return counters().find(function_name);
+}
+
 void drti::maybe_log_treenode(treenode* node)
 {
-    if(config.log_level >= log_level::info)
+    if(log_enabled(log_level::info))
     {
-        log_stream << "DRTI ";
+        log_stream() << "DRTI ";
         if(node->parent)
         {
-            log_stream
-                << node->parent->location.landing.total_called
+            log_stream()
+                << landing_total(node->parent->location.landing)
                 << " * "
                 << node->parent->location.landing.global_name
                 << " via "
@@ -204,12 +783,12 @@ void drti::maybe_log_treenode(treenode* node)
         }
         else
         {
-            log_stream << "(unknown)";
+            log_stream() << "(unknown)";
         }
 
-        log_stream
+        log_stream()
             << " -> "
-            << node->location.landing.total_called
+            << landing_total(node->location.landing)
             << " * "
             << node->location.landing.function_name
             << " "
@@ -221,18 +800,24 @@ void drti::maybe_log_treenode(treenode* node)
             << " * "
             << node->landing->function_name
             << " ("
-            << node->landing->total_called
-            << " total)"
-            << std::endl;
+            << landing_total(*node->landing)
+            << " total)";
+
+        if(node->location.timed)
+        {
+            log_stream() << " ~" << node->chain_cycles << " cycles";
+        }
+
+        log_stream() << std::endl;
     }
 }
 
 void drti::maybe_log_error(
     const landing_site& landing, const char* context, const char* message)
 {
-    if(config.log_level >= log_level::error)
+    if(log_enabled(log_level::error))
     {
-        log_stream
+        log_stream()
             << "DRTI "
             << landing.function_name
             << " "
@@ -252,7 +837,32 @@ void drti::inspect_treenode(treenode* node)
 
     maybe_log_treenode(node);
 
-    if(node->parent)
+    if(!config.compile)
+    {
+        return;
+    }
+
+    // Chains from profiled call sites get compiled once they have
+    // enough samples (see _drti_call_from_profiled)
+    if(node->profile.samples &&
+       (node->profile.samples < value_profile_samples))
+    {
+        return;
+    }
+
+    // Likewise timed call sites once enough time has been spent in
+    // the chain (see _drti_timed_call)
+    if(node->location.timed && (node->chain_cycles < hot_chain_cycles))
+    {
+        return;
+    }
+
+    // Without a decorated parent the only way to reach the compiled
+    // code is via the caller's own (patched) entry point
+    if(node->parent ||
+       (config.entry_patching &&
+        node->location.landing.patchable_entry &&
+        !entry_patched(node->location.landing)))
     {
         try
         {
@@ -264,22 +874,75 @@ void drti::inspect_treenode(treenode* node)
     }
 }
 
-drti::ReflectedModule::ReflectedModule(
-    llvm::LLVMContext& context, landing_site& site) :
-
-    m_landing_site(site),
-    m_self(*m_landing_site.self),
-    m_ownModule(readModule(context)),
-    m_module(m_ownModule.get())
+void drti::hot_treenode(treenode* node)
 {
-}
+    if(!abi_ok(node->caller_abi_version) ||
+       !config.compile ||
+       !config.host_isa)
+    {
+        return;
+    }
 
-std::unique_ptr<llvm::Module> drti::ReflectedModule::readModule(
-    llvm::LLVMContext& context)
-{
-    assert(m_landing_site.self);
+    // Nothing to do if the caller already uses a compiled chain
+    // through this node
+    if(node->resolved_target != node->target)
+    {
+        return;
+    }
+
+    // Nor if the caller itself has been replaced by compiled code
+    // (e.g. by inspect_treenode compiling this chain just before a
+    // timed call site reports it hot), since the compiled code
+    // doesn't go through this node
+    if(node->parent ?
+       (node->parent->resolved_target != node->parent->target) :
+       entry_patched(node->location.landing))
+    {
+        return;
+    }
+
+    try
+    {
+        retarget_treenode(node);
+    }
+    catch(const InternalCompilerError&)
+    {
+    }
+}
+
+drti::ReflectedModule::ReflectedModule(
+    llvm::LLVMContext& context, landing_site& site) :
+
+    ReflectedModule(context, site, *site.self)
+{
+}
+
+drti::ReflectedModule::ReflectedModule(
+    llvm::LLVMContext& context, landing_site& site, reflect& self) :
+
+    m_landing_site(site),
+    m_self(self),
+    m_ownModule(readModule(context)),
+    m_module(m_ownModule.get())
+{
+}
+
+drti::ReflectedModule::ReflectedModule(
+    landing_site& site, ReflectedModule& sibling) :
+
+    m_landing_site(site),
+    m_self(sibling.m_self),
+    m_ownModule(std::move(sibling.m_ownModule)),
+    m_module(m_ownModule.get())
+{
+    // The sibling keeps its non-owned pointer
+    assert(sibling.m_module == m_module);
+}
 
-    llvm::StringRef string(m_self.module, m_self.module_size);
+std::unique_ptr<llvm::Module> drti::ReflectedModule::readModule(
+    llvm::LLVMContext& context)
+{
+    llvm::StringRef string(reflected_bitcode(m_self));
 
     auto buffer(
         llvm::MemoryBuffer::getMemBuffer(string, "bitcode", false));
@@ -298,9 +961,9 @@ std::unique_ptr<llvm::Module> drti::ReflectedModule::readModule(
 
     CHECK_WRAPPER(m_landing_site, "parseBitcodeFile", maybeModule);
 
-    if(config.log_level >= log_level::info)
+    if(log_enabled(log_level::info))
     {
-        log_stream
+        log_stream()
             << "DRTI module for "
             << m_landing_site.function_name
             << " of size "
@@ -316,20 +979,20 @@ llvm::Function* drti::ReflectedModule::callsite_function()
     llvm::Function* func = m_module->getFunction(m_landing_site.function_name);
     if(!func)
     {
-        if(config.log_level >= log_level::error)
+        if(log_enabled(log_level::error))
         {
-            log_stream
+            log_stream()
                 << "DRTI "
                 << m_landing_site.function_name
                 << " not found in bitcode. Globals dump follows:\n";
 
             for(llvm::Function& function: m_module->functions())
             {
-                log_stream << "DRTI " << function.getName().str() << "\n";
+                log_stream() << "DRTI " << function.getName().str() << "\n";
             }
             for(llvm::GlobalVariable& global: m_module->globals())
             {
-                log_stream << "DRTI " << global.getName().str() << "\n";
+                log_stream() << "DRTI " << global.getName().str() << "\n";
             }
         }
         throw InternalCompilerError();
@@ -340,8 +1003,7 @@ llvm::Function* drti::ReflectedModule::callsite_function()
 
 void drti::ReflectedModule::globalsMap(
     llvm::orc::SymbolMap& map,
-    llvm::orc::MangleAndInterner& mangler,
-    llvm::Module& availableModule)
+    llvm::orc::MangleAndInterner& mangler)
 {
     // We must process these in exactly the same order as the code
     // that populated the reflect.globals (see drti-decorate.cpp)
@@ -350,9 +1012,9 @@ void drti::ReflectedModule::globalsMap(
     auto addNext = [&](llvm::StringRef name) {
         if(index >= m_self.globals_size)
         {
-            if(config.log_level >= log_level::error)
+            if(log_enabled(log_level::error))
             {
-                log_stream
+                log_stream()
                     << "DRTI "
                     << m_landing_site.function_name
                     << " module has "
@@ -371,9 +1033,9 @@ void drti::ReflectedModule::globalsMap(
 
         llvm::orc::SymbolStringPtr symbol = mangler(name);
 
-        if(config.log_level >= log_level::debug)
+        if(log_enabled(log_level::debug))
         {
-            log_stream
+            log_stream()
                 << "DRTI "
                 << (*symbol).str()
                 << " runtime address "
@@ -391,10 +1053,12 @@ void drti::ReflectedModule::globalsMap(
         [&addNext](llvm::GlobalVariable& variable) {
             addNext(variable.getName());
 
-            // Force "internal" variables to resolve against the
-            // original copy compiled ahead-of-time and saved in the
-            // reflected globals list. This is essential for static
-            // initialisers to work and only be invoked once.
+            // Force variable definitions, "internal" or otherwise,
+            // to resolve against the original copy compiled
+            // ahead-of-time and saved in the reflected globals list.
+            // This is essential for static initialisers to work and
+            // only be invoked once, and also stops two of the modules
+            // we link from both defining the same variable.
             //
             // TODO - we could add special handling for static
             // initialisation guard variables and completely elide
@@ -402,7 +1066,7 @@ void drti::ReflectedModule::globalsMap(
             // initialised at JIT time. Actually in general some
             // variables have only two states and we could convert
             // them to compile-time constants given enough knowledge.
-            if(variable.hasLocalLinkage())
+            if(!variable.isDeclaration())
             {
                 variable.setLinkage(
                     llvm::GlobalValue::AvailableExternallyLinkage);
@@ -415,62 +1079,140 @@ void drti::ReflectedModule::globalsMap(
         // in collect_globals from drti-decorate.cpp
         if(function.isDeclaration() && !function.isIntrinsic())
         {
-            llvm::Function* found =
-                availableModule.getFunction(function.getName());
-
-            if(found && !found->isDeclaration())
-            {
-                // We have a definition for this function so
-                // potentially want to recompile it at runtime, rather
-                // than resolving against a saved global address.
-                if(config.log_level >= log_level::debug)
-                {
-                    log_stream
-                        << "DRTI not mapping available function "
-                        << function.getName().str()
-                        << "\n";
-                }
-            }
-            else
-            {
-                addNext(function.getName());
-            }
+            addNext(function.getName());
         }
     }
 }
 
-drti::TreenodeCompiler::TreenodeCompiler(treenode* node) :
-    m_node(node),
-    m_thread_safe_context(llvmContext()),
-    m_lock(m_thread_safe_context.getLock()),
-    m_context(*m_thread_safe_context.getContext()),
-    m_leaf(m_context, *m_node->landing),
-    m_caller(m_context, m_node->location.landing),
-    m_jit(createJit())
+//! Attach the branch counts recorded by a function decorated with
+//! DRTI_PROFILE_BRANCHES as branch weights, and its landing count as
+//! the entry count, for profile-guided optimisation and block layout
+static void applyBranchProfile(
+    llvm::Function& function, const drti::landing_site& landing)
 {
-    llvm::orc::LLJIT& jit(*m_jit);
+    using namespace drti;
 
-    // For symbols such as _Unwind_Resume
-    jit.getExecutionSession().getMainJITDylib().setGenerator(
-        llvm::cantFail(
-            llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
-                jit.getDataLayout().getGlobalPrefix())));
+    if(!landing.branch_counts)
+    {
+        return;
+    }
 
-    llvm::orc::MangleAndInterner mangler(
-        jit.getExecutionSession(), jit.getDataLayout());
+    std::vector<llvm::BranchInst*> branches;
+    visit_conditional_branches(
+        function,
+        [&branches](llvm::BranchInst& branch) {
+            branches.push_back(&branch);
+        });
 
-    llvm::orc::SymbolMap globals_map;
+    if(branches.size() != landing.branches)
+    {
+        if(log_enabled(log_level::warn))
+        {
+            log_stream()
+                << "DRTI "
+                << landing.function_name
+                << " has "
+                << branches.size()
+                << " branches but "
+                << landing.branches
+                << " were counted\n";
+        }
+        return;
+    }
+
+    llvm::MDBuilder builder(function.getContext());
+    size_t weighted = 0;
+
+    for(size_t index = 0; index < branches.size(); ++index)
+    {
+        uint64_t first = landing.branch_counts[2 * index];
+        uint64_t second = landing.branch_counts[2 * index + 1];
+
+        if(!first && !second)
+        {
+            continue;
+        }
+
+        // Branch weights are only 32 bits
+        while(std::max(first, second) > std::numeric_limits<uint32_t>::max())
+        {
+            first >>= 1;
+            second >>= 1;
+        }
+
+        branches[index]->setMetadata(
+            llvm::LLVMContext::MD_prof,
+            builder.createBranchWeights(first, second));
+        ++weighted;
+    }
+
+    // An entry count of zero would mark the function as cold, just
+    // as we're making it hot
+    const int64_t entries = landing_total(landing);
+    if(entries)
+    {
+        function.setEntryCount(entries);
+    }
+    weighted_branch_count() += weighted;
+
+    if(log_enabled(log_level::info))
+    {
+        log_stream()
+            << "DRTI "
+            << landing.function_name
+            << " entry count "
+            << entries
+            << ", weights for "
+            << weighted
+            << " of "
+            << branches.size()
+            << " branch(es)\n";
+    }
+}
+
+//! Count entries to the compiled version of a function, using an
+//! atomic add at a fixed address. This is the only bookkeeping in
+//! the compiled code, however much gets inlined into it.
+static void addEntryCounter(llvm::Function& function, drti::counter_t& counter)
+{
+    llvm::IRBuilder<> builder(&*function.getEntryBlock().getFirstInsertionPt());
 
-    m_leaf.globalsMap(globals_map, mangler, *m_caller.m_module);
-    m_caller.globalsMap(globals_map, mangler, *m_leaf.m_module);
+    llvm::Value* address = builder.CreateIntToPtr(
+        builder.getInt64(reinterpret_cast<uintptr_t>(&counter)),
+        builder.getInt64Ty()->getPointerTo(),
+        "drtiEntryCounter");
+
+    builder.CreateAtomicRMW(
+        llvm::AtomicRMWInst::Add, address, builder.getInt64(1),
+        llvm::AtomicOrdering::Monotonic);
+}
+
+//! Whether a new compilation can go in the JIT heap
+static bool useJitHeap()
+{
+    return drti::config.near_code && drti::jit_heap_available();
+}
 
-    llvm::cantFail(
-        jit.getMainJITDylib().define(
-            llvm::orc::absoluteSymbols(globals_map)));
+//! The root of the chain containing a treenode, which keeps code for
+//! the whole chain together in the JIT heap
+static const drti::treenode* chainRoot(const drti::treenode* node)
+{
+    while(node->parent)
+    {
+        node = node->parent;
+    }
+    return node;
 }
 
-std::unique_ptr<llvm::orc::LLJIT> drti::TreenodeCompiler::createJit()
+//! A JIT for the host, which also resolves symbols from the process
+//! itself. With near_code set it allocates from the JIT heap, within
+//! rel32 range of the main program, next to other code with the same
+//! affinity.
+static std::unique_ptr<llvm::orc::LLJIT> createJit(
+    const drti::landing_site& landing, bool near_code, const void* affinity)
 {
+    using namespace drti;
+
     llvm::orc::JITTargetMachineBuilder jtmb(
         llvm::cantFail(llvm::orc::JITTargetMachineBuilder::detectHost()));
     // I think this controls machine code optimizations only (not the
@@ -480,166 +1222,519 @@ std::unique_ptr<llvm::orc::LLJIT> drti::TreenodeCompiler::createJit()
     // the compilation is not sufficiently lazy
     // jtmb.getOptions().PrintMachineCode = 1;
 
-    // Code and data can be very far apart
-    jtmb.setCodeModel(llvm::CodeModel::Large);
-
     llvm::orc::LLJITBuilder bs;
+
+    if(near_code)
+    {
+        // Position independent, so that anything out of range (see
+        // defineGlobals) goes via the GOT or a stub
+        jtmb.setCodeModel(llvm::CodeModel::Small);
+        jtmb.setRelocationModel(llvm::Reloc::PIC_);
+
+        bs.setObjectLinkingLayerCreator(
+            [affinity](llvm::orc::ExecutionSession& session) {
+                return std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(
+                    session,
+                    [affinity]() { return jit_heap_memory_manager(affinity); });
+            });
+    }
+    else
+    {
+        // Code and data can be very far apart
+        jtmb.setCodeModel(llvm::CodeModel::Large);
+    }
+
     bs.setJITTargetMachineBuilder(jtmb);
 
     auto maybeJit(bs.create());
 
-    CHECK_WRAPPER(m_node->location.landing, "LLJIT::Create", maybeJit);
+    CHECK_WRAPPER(landing, "LLJIT::Create", maybeJit);
+
+    llvm::orc::LLJIT& jit(**maybeJit);
+
+    // For symbols such as _Unwind_Resume
+    jit.getExecutionSession().getMainJITDylib().setGenerator(
+        llvm::cantFail(
+            llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+                jit.getDataLayout().getGlobalPrefix())));
 
     return std::move(*maybeJit);
 }
 
-void drti::TreenodeCompiler::linkModules()
+//! Resolve everything the module doesn't define against the
+//! addresses stored at ahead-of-time compilation. For code in the JIT
+//! heap, references to the symbols it can reach are marked dso_local
+//! so they become direct calls and rip-relative addresses, and any
+//! others go via the GOT or a stub.
+static void defineGlobals(
+    llvm::orc::LLJIT& jit,
+    llvm::Module& module,
+    llvm::orc::SymbolMap globals_map,
+    const drti::landing_site& landing,
+    bool near_code)
 {
-    if(config.log_level >= log_level::debug)
+    using namespace drti;
+
+    llvm::orc::MangleAndInterner mangler(
+        jit.getExecutionSession(), jit.getDataLayout());
+
+    for(llvm::Function& function: module)
     {
-        llvm::raw_os_ostream stream(std::cerr);
-        std::unique_ptr<llvm::ModulePass> printer(
-            llvm::createPrintModulePass(
-                stream, "------- drti linking -------"));
-        printer->runOnModule(*m_caller.m_module);
-        printer->runOnModule(*m_leaf.m_module);
+        // We have a definition for this function so we want to
+        // (re)compile it rather than resolving against a saved global
+        // address.
+        if(!function.isDeclaration() &&
+           !function.hasAvailableExternallyLinkage() &&
+           globals_map.erase(mangler(function.getName())) &&
+           log_enabled(log_level::debug))
+        {
+            log_stream()
+                << "DRTI not mapping available function "
+                << function.getName().str()
+                << "\n";
+        }
     }
 
-    llvm::Linker linker(*m_caller.m_module);
-    if(linker.linkInModule(
-           std::move(m_leaf.m_ownModule), llvm::Linker::LinkOnlyNeeded))
+    if(near_code)
     {
-        maybe_log_error(
-            m_leaf.m_landing_site,
-            "TreenodeCompiler::createJit",
-            "Linking failed");
+        for(llvm::GlobalValue& global: module.global_values())
+        {
+            if((!global.isDeclaration() &&
+                !global.hasAvailableExternallyLinkage()) ||
+               (llvm::isa<llvm::Function>(global) &&
+                llvm::cast<llvm::Function>(global).isIntrinsic()))
+            {
+                continue;
+            }
 
-        throw InternalCompilerError();
+            auto found = globals_map.find(mangler(global.getName()));
+            global.setDSOLocal(
+                (found != globals_map.end()) &&
+                jit_heap_reaches(
+                    reinterpret_cast<const void*>(found->second.getAddress())));
+        }
     }
 
-    // m_leaf.m_ownModule is empty now, and we redirect its non-owned
-    // pointer here
-    m_leaf.m_module = m_caller.m_module;
+    llvm::Error bad = jit.getMainJITDylib().define(
+        llvm::orc::absoluteSymbols(std::move(globals_map)));
+
+    CHECK_ERROR(landing, "define globals", bad);
 }
 
-static std::string describeType(llvm::Type* type)
+//! The host CPU features in target-features attribute form, e.g.
+//! "+avx2,-avx512f,..."
+static std::string hostCPUFeatures()
 {
-    // Currently only works for struct types and pointers thereto
+    llvm::SubtargetFeatures features;
+    llvm::StringMap<bool> host;
 
-    std::string suffix;
-    while(llvm::PointerType* cast = llvm::dyn_cast<llvm::PointerType>(type))
+    if(llvm::sys::getHostCPUFeatures(host))
     {
-        suffix += "*";
-        type = cast->getElementType();
+        for(const llvm::StringMapEntry<bool>& feature: host)
+        {
+            features.AddFeature(feature.first(), feature.second);
+        }
     }
 
-    if(type->isStructTy())
-    {
-        return type->getStructName().str() + suffix;
-    }
-    else
-    {
-        return std::string();
-    }
+    return features.getString();
 }
 
-llvm::Function* drti::TreenodeCompiler::findConverter(
-    llvm::Type* fromType, llvm::Type* toType) const
+//! Replace the CPU and features that each function was compiled for
+//! ahead of time with those of the host. The function attributes
+//! take precedence over the JIT's target machine, which already
+//! describes the host.
+static void retargetForHost(llvm::Module& module)
 {
-    for(llvm::Function& function: *m_leaf.m_module)
+    static const std::string cpu(llvm::sys::getHostCPUName());
+    static const std::string features(hostCPUFeatures());
+
+    for(llvm::Function& function: module)
     {
-        // Workaround C++ name mangling on the __drti_converter
-        if((function.getName().str().find("__drti_converter") != std::string::npos)
-           && (function.arg_size() == 2)
-           && (function.arg_begin()->getType() == fromType)
-           && ((function.arg_begin() + 1)->getType() == toType)
-           && (function.getReturnType() == toType))
+        if(!function.isDeclaration())
         {
-            return &function;
+            function.removeFnAttr("target-cpu");
+            function.removeFnAttr("target-features");
+            function.addFnAttr("target-cpu", cpu);
+            function.addFnAttr("target-features", features);
         }
     }
-    return nullptr;
 }
 
-llvm::Value* drti::TreenodeCompiler::maybeCoerce(
-    llvm::IRBuilder<>& builder,
-    llvm::Use& argUse,
-    llvm::Argument& parameter,
-    int alreadyCoerced) const
+//! Run the O3 pipeline over the module and then the function passes
+//! over the named functions, skipping any that the module passes
+//! deleted (e.g. after inlining them everywhere). With
+//! config.reoptimize this includes loop and SLP vectorisation and
+//! uses the host's target transform information, so that loops in
+//! inlined code can take advantage of constant arguments and the
+//! host's vector units.
+static void optimizeModule(
+    llvm::Module& module,
+    llvm::Pass* inliner,
+    llvm::ArrayRef<std::string> function_names,
+    const drti::landing_site& landing)
 {
-    llvm::Type* useType = argUse.get()->getType();
-    llvm::Type* paramType = parameter.getType();
+    using namespace drti;
 
-    if(useType == paramType)
+    llvm::PassManagerBuilder pmb;
+    pmb.Inliner = inliner;
+    pmb.OptLevel = 3;
+
+    // Must outlive the pass managers
+    std::unique_ptr<llvm::TargetMachine> target;
+
+    if(config.reoptimize)
     {
-        return argUse.get();
+        auto jtmb(
+            llvm::cantFail(llvm::orc::JITTargetMachineBuilder::detectHost()));
+        jtmb.setCodeGenOptLevel(llvm::CodeGenOpt::Aggressive);
+
+        auto maybeTarget(jtmb.createTargetMachine());
+
+        CHECK_WRAPPER(landing, "createTargetMachine", maybeTarget);
+
+        target = std::move(*maybeTarget);
+
+        pmb.LoopVectorize = true;
+        pmb.SLPVectorize = true;
+        pmb.DisableUnrollLoops = false;
+        target->adjustPassManager(pmb);
     }
-    else if(alreadyCoerced > 1 || parameter.getArgNo() > 1)
+
+    llvm::legacy::PassManager mpm;
+
+    if(target)
     {
-        // Sanity check - the virtual function's "this" pointer can't
-        // be later than the second parameter and we would never have
-        // more than two coercions in a single virtual function
-        // call. On the other hand we do want to allow covariant
-        // return types and return value optimisation.
-        return nullptr;
+        mpm.add(llvm::createTargetTransformInfoWrapperPass(
+                    target->getTargetIRAnalysis()));
     }
-    else if(llvm::Function* converter = findConverter(useType, paramType))
+
+    pmb.populateModulePassManager(mpm);
+
+    mpm.run(module);
+
+    llvm::legacy::FunctionPassManager fpm(&module);
+
+    if(target)
     {
-        llvm::Value* converterArg[] = {
-            argUse.get(), llvm::Constant::getNullValue(paramType)
-        };
-        llvm::Value* result = builder.CreateCall(
-            converter, converterArg, "drti_coerced");
-        ++alreadyCoerced;
-        return result;
+        fpm.add(llvm::createTargetTransformInfoWrapperPass(
+                    target->getTargetIRAnalysis()));
     }
-    else
+
+    pmb.populateFunctionPassManager(fpm);
+
+    for(const std::string& name: function_names)
     {
-        return nullptr;
+        if(llvm::Function* function = module.getFunction(name))
+        {
+            fpm.run(*function);
+        }
     }
 }
 
-llvm::Value* drti::TreenodeCompiler::argTypeMismatch(
-    const llvm::Use& argUse,
-    const llvm::Argument& parameter,
-    const llvm::Function& function) const
+drti::TreenodeCompiler::TreenodeCompiler(treenode* node) :
+    m_node(node),
+    m_thread_safe_context(llvmContext()),
+    m_lock(m_thread_safe_context.getLock()),
+    m_context(*m_thread_safe_context.getContext()),
+    m_leaf(m_context, *m_node->landing),
+    m_caller(callerModule()),
+    m_near_code(useJitHeap())
 {
-    llvm::Type* useType = argUse.get()->getType();
-    llvm::Type* paramType = parameter.getType();
-    if(config.log_level >= log_level::error)
-    {
-        log_stream
-            << "DRTI type mismatch for call resolved to "
-            << function.getName().str()
-            << " at argument "
-            // These number from zero as you undoutably know
-            << parameter.getArgNo();
+}
 
-        std::string useTypeName = describeType(useType);
-        std::string paramTypeName = describeType(paramType);
+void drti::TreenodeCompiler::prepare()
+{
+    m_jit = createJit(m_node->location.landing, m_near_code, chainRoot(m_node));
 
-        if(!useTypeName.empty() && ! paramTypeName.empty())
-        {
-            log_stream
-                << " (" << useTypeName
-                << " but expecting " << paramTypeName
-                << ")";
-        }
+    llvm::orc::LLJIT& jit(*m_jit);
 
-        log_stream
-            << "\n";
+    addExtraModules();
+
+    llvm::orc::MangleAndInterner mangler(
+        jit.getExecutionSession(), jit.getDataLayout());
+
+    m_leaf.globalsMap(m_globals_map, mangler);
+    if(m_caller.m_module != m_leaf.m_module)
+    {
+        m_caller.globalsMap(m_globals_map, mangler);
+    }
+    for(const std::unique_ptr<ReflectedModule>& extra: m_extras)
+    {
+        extra->globalsMap(m_globals_map, mangler);
     }
-    throw InternalCompilerError();
 }
 
-void drti::TreenodeCompiler::reprocess(
-    llvm::CallBase* callInst, ReflectedModule& leaf)
+//! Chains within one translation unit are common, and in that case
+//! the caller shares the leaf's parsed module so we neither parse
+//! the same bitcode twice nor link two copies of it
+drti::ReflectedModule drti::TreenodeCompiler::callerModule()
 {
-    // Split the existing block
-    // BB1:
-    //   xxx
-    //   original = call value(...)
-    //   yyy
+    landing_site& site(m_node->location.landing);
+
+    if(site.self != &m_leaf.m_self)
+    {
+        return ReflectedModule(m_context, site);
+    }
+
+    if(log_enabled(log_level::info))
+    {
+        log_stream()
+            << "DRTI "
+            << site.function_name
+            << " shares its module with "
+            << m_leaf.m_landing_site.function_name
+            << "\n";
+    }
+
+    return ReflectedModule(site, m_leaf);
+}
+
+void drti::TreenodeCompiler::linkModules()
+{
+    if(log_enabled(log_level::debug))
+    {
+        llvm::raw_os_ostream stream(log_stream());
+        std::unique_ptr<llvm::ModulePass> printer(
+            llvm::createPrintModulePass(
+                stream, "------- drti linking -------"));
+        printer->runOnModule(*m_caller.m_module);
+        if(m_leaf.m_module != m_caller.m_module)
+        {
+            printer->runOnModule(*m_leaf.m_module);
+        }
+    }
+
+    llvm::Linker linker(*m_caller.m_module);
+
+    // Nothing to do for the leaf if it shares the caller's module
+    if(m_leaf.m_ownModule)
+    {
+        if(linker.linkInModule(
+               std::move(m_leaf.m_ownModule), llvm::Linker::LinkOnlyNeeded))
+        {
+            maybe_log_error(
+                m_leaf.m_landing_site,
+                "TreenodeCompiler::createJit",
+                "Linking failed");
+
+            throw InternalCompilerError();
+        }
+
+        // m_leaf.m_ownModule is empty now, and we redirect its
+        // non-owned pointer here
+        m_leaf.m_module = m_caller.m_module;
+    }
+
+    for(const std::unique_ptr<ReflectedModule>& extra: m_extras)
+    {
+        if(linker.linkInModule(
+               std::move(extra->m_ownModule), llvm::Linker::LinkOnlyNeeded))
+        {
+            maybe_log_error(
+                m_leaf.m_landing_site,
+                "TreenodeCompiler::linkModules",
+                "Linking extra module failed");
+
+            throw InternalCompilerError();
+        }
+
+        extra->m_module = m_caller.m_module;
+    }
+}
+
+//! Find registered modules defining functions that the caller or the
+//! leaf call but don't define between them, so that linking them in
+//! lets the optimiser inline beyond the two modules. Limited to
+//! config.link_modules extra modules.
+void drti::TreenodeCompiler::addExtraModules()
+{
+    if(config.link_modules <= 0)
+    {
+        return;
+    }
+
+    std::unordered_set<const reflect*> loaded{&m_caller.m_self, &m_leaf.m_self};
+
+    for(ReflectedModule* module: {&m_caller, &m_leaf})
+    {
+        llvm::Module& other(
+            (module == &m_caller) ? *m_leaf.m_module : *m_caller.m_module);
+
+        for(llvm::BasicBlock& block: *module->callsite_function())
+        {
+            for(llvm::Instruction& instruction: block)
+            {
+                auto callInst = llvm::dyn_cast<llvm::CallBase>(&instruction);
+                llvm::Function* callee =
+                    callInst ? callInst->getCalledFunction() : nullptr;
+
+                if(!callee || !callee->isDeclaration() || callee->isIntrinsic())
+                {
+                    continue;
+                }
+
+                llvm::Function* sibling = other.getFunction(callee->getName());
+                if(sibling && !sibling->isDeclaration())
+                {
+                    continue;
+                }
+
+                reflect* defining =
+                    registry().defining_module(m_context, callee->getName());
+
+                if(!defining || !loaded.insert(defining).second)
+                {
+                    continue;
+                }
+
+                if(m_extras.size() >= static_cast<size_t>(config.link_modules))
+                {
+                    if(log_enabled(log_level::info))
+                    {
+                        log_stream()
+                            << "DRTI module budget exhausted, not linking "
+                            << callee->getName().str()
+                            << "\n";
+                    }
+                    return;
+                }
+
+                if(log_enabled(log_level::info))
+                {
+                    log_stream()
+                        << "DRTI linking module defining "
+                        << callee->getName().str()
+                        << " called from "
+                        << module->m_landing_site.function_name
+                        << "\n";
+                }
+
+                m_extras.emplace_back(
+                    std::make_unique<ReflectedModule>(
+                        m_context, m_leaf.m_landing_site, *defining));
+            }
+        }
+    }
+}
+
+static std::string describeType(llvm::Type* type)
+{
+    // Currently only works for struct types and pointers thereto
+
+    std::string suffix;
+    while(llvm::PointerType* cast = llvm::dyn_cast<llvm::PointerType>(type))
+    {
+        suffix += "*";
+        type = cast->getElementType();
+    }
+
+    if(type->isStructTy())
+    {
+        return type->getStructName().str() + suffix;
+    }
+    else
+    {
+        return std::string();
+    }
+}
+
+llvm::Function* drti::TreenodeCompiler::findConverter(
+    llvm::Type* fromType, llvm::Type* toType) const
+{
+    for(llvm::Function& function: *m_leaf.m_module)
+    {
+        // Workaround C++ name mangling on the __drti_converter
+        if((function.getName().str().find("__drti_converter") != std::string::npos)
+           && (function.arg_size() == 2)
+           && (function.arg_begin()->getType() == fromType)
+           && ((function.arg_begin() + 1)->getType() == toType)
+           && (function.getReturnType() == toType))
+        {
+            return &function;
+        }
+    }
+    return nullptr;
+}
+
+llvm::Value* drti::TreenodeCompiler::maybeCoerce(
+    llvm::IRBuilder<>& builder,
+    llvm::Use& argUse,
+    llvm::Argument& parameter,
+    int alreadyCoerced) const
+{
+    llvm::Type* useType = argUse.get()->getType();
+    llvm::Type* paramType = parameter.getType();
+
+    if(useType == paramType)
+    {
+        return argUse.get();
+    }
+    else if(alreadyCoerced > 1 || parameter.getArgNo() > 1)
+    {
+        // Sanity check - the virtual function's "this" pointer can't
+        // be later than the second parameter and we would never have
+        // more than two coercions in a single virtual function
+        // call. On the other hand we do want to allow covariant
+        // return types and return value optimisation.
+        return nullptr;
+    }
+    else if(llvm::Function* converter = findConverter(useType, paramType))
+    {
+        llvm::Value* converterArg[] = {
+            argUse.get(), llvm::Constant::getNullValue(paramType)
+        };
+        llvm::Value* result = builder.CreateCall(
+            converter, converterArg, "drti_coerced");
+        ++alreadyCoerced;
+        return result;
+    }
+    else
+    {
+        return nullptr;
+    }
+}
+
+llvm::Value* drti::TreenodeCompiler::argTypeMismatch(
+    const llvm::Use& argUse,
+    const llvm::Argument& parameter,
+    const llvm::Function& function) const
+{
+    llvm::Type* useType = argUse.get()->getType();
+    llvm::Type* paramType = parameter.getType();
+    if(log_enabled(log_level::error))
+    {
+        log_stream()
+            << "DRTI type mismatch for call resolved to "
+            << function.getName().str()
+            << " at argument "
+            // These number from zero as you undoutably know
+            << parameter.getArgNo();
+
+        std::string useTypeName = describeType(useType);
+        std::string paramTypeName = describeType(paramType);
+
+        if(!useTypeName.empty() && ! paramTypeName.empty())
+        {
+            log_stream()
+                << " (" << useTypeName
+                << " but expecting " << paramTypeName
+                << ")";
+        }
+
+        log_stream()
+            << "\n";
+    }
+    throw InternalCompilerError();
+}
+
+void drti::TreenodeCompiler::reprocess(
+    llvm::CallBase* callInst, ReflectedModule& leaf)
+{
+    // Split the existing block
+    // BB1:
+    //   xxx
+    //   original = call value(...)
+    //   yyy
     //
     // like this:
     // BB1:
@@ -671,6 +1766,32 @@ void drti::TreenodeCompiler::reprocess(
     llvm::Value* matches = builder.CreateICmpEQ(
         target, knownTarget, "matches");
 
+    // The treenode's target might be a PLT stub, e.g. a non-PIE
+    // executable's canonical address for a shared library function,
+    // in which case other pointers to the same function can hold
+    // the real address instead. Both are fine for the fast path.
+    const void* resolvedTarget = resolve_plt(m_node->target);
+    if(resolvedTarget != m_node->target)
+    {
+        if(log_enabled(log_level::info))
+        {
+            log_stream()
+                << "DRTI call target "
+                << m_node->target
+                << " resolved via PLT to "
+                << resolvedTarget
+                << "\n";
+        }
+
+        llvm::Value* matchesResolved = builder.CreateICmpEQ(
+            target,
+            llvm::ConstantInt::get(
+                int64, reinterpret_cast<uintptr_t>(resolvedTarget)),
+            "matchesResolved");
+
+        matches = builder.CreateOr(matches, matchesResolved, "matches");
+    }
+
     llvm::BasicBlock* bb1 = callInst->getParent();
     llvm::BasicBlock* bb3 = bb1->splitBasicBlock(callInst, "drti_bb3");
     llvm::BasicBlock* bb4 = bb3->splitBasicBlock(
@@ -687,11 +1808,14 @@ void drti::TreenodeCompiler::reprocess(
     // The inlinable function call
     builder.SetInsertPoint(bb2);
 
-    if(callInst->arg_size() != leaf.callsite_function()->arg_size())
+    // Any extra arguments to a variadic leaf are passed as they are
+    if((callInst->arg_size() < leaf.callsite_function()->arg_size()) ||
+       ((callInst->arg_size() > leaf.callsite_function()->arg_size()) &&
+        !leaf.callsite_function()->isVarArg()))
     {
-        if(config.log_level >= log_level::error)
+        if(log_enabled(log_level::error))
         {
-            log_stream
+            log_stream()
                 << "DRTI call with "
                 << callInst->arg_size()
                 << " arguments resolved to "
@@ -703,14 +1827,80 @@ void drti::TreenodeCompiler::reprocess(
         throw InternalCompilerError();
     }
 
+    // A virtual call via a secondary base class goes to a thunk that
+    // adjusts the this pointer and jumps to the real function, which
+    // is where we landed. The direct call has to make the same
+    // adjustment, and this replaces any DRTI_CONVERTIBLE conversion
+    // for the argument.
+    thunk_adjustment adjustment;
+    const void* thunkTarget = resolve_thunk(resolvedTarget, adjustment);
+
+    // Anything that adjusts an argument and then jumps elsewhere
+    // looks like a thunk, but the adjustment only stands in for it if
+    // it jumps straight to the function we landed in
+    const void* leafEntry = resolve_plt(leaf.m_landing_site.entry);
+    if(thunkTarget && thunkTarget != leafEntry)
+    {
+        if(log_enabled(log_level::info))
+        {
+            log_stream()
+                << "DRTI call target "
+                << resolvedTarget
+                << " jumps to "
+                << thunkTarget
+                << " rather than "
+                << leafEntry
+                << ", not treating it as a thunk\n";
+        }
+        thunkTarget = nullptr;
+    }
+
+    if(thunkTarget && log_enabled(log_level::info))
+    {
+        log_stream()
+            << "DRTI call target "
+            << resolvedTarget
+            << " is a thunk adjusting argument "
+            << adjustment.argument
+            << " by "
+            << adjustment.offset
+            << " for "
+            << thunkTarget
+            << "\n";
+    }
+
     llvm::SmallVector<llvm::Value*, 20> args;
-    llvm::iterator_range<llvm::Function::arg_iterator> targetArgs(
-        leaf.callsite_function()->args());
     int alreadyCoerced = 0;
     for(llvm::Use& argUse: callInst->arg_operands())
     {
-        llvm::Value* arg =
-            maybeCoerce(builder, argUse, *targetArgs.begin(), alreadyCoerced);
+        if(argUse.getOperandNo() >= leaf.callsite_function()->arg_size())
+        {
+            args.push_back(argUse.get());
+            continue;
+        }
+
+        llvm::Argument& parameter(
+            *(leaf.callsite_function()->arg_begin() + argUse.getOperandNo()));
+
+        llvm::Value* arg = nullptr;
+
+        if(thunkTarget &&
+           (argUse.getOperandNo() == adjustment.argument) &&
+           argUse.get()->getType()->isPointerTy() &&
+           parameter.getType()->isPointerTy())
+        {
+            llvm::Value* adjusted = builder.CreateGEP(
+                builder.getInt8Ty(),
+                builder.CreatePointerCast(argUse.get(), builder.getInt8PtrTy()),
+                builder.getInt64(adjustment.offset),
+                "drti_adjusted");
+
+            arg = builder.CreatePointerCast(adjusted, parameter.getType());
+        }
+        else
+        {
+            arg = maybeCoerce(builder, argUse, parameter, alreadyCoerced);
+        }
 
         if(arg)
         {
@@ -718,17 +1908,12 @@ void drti::TreenodeCompiler::reprocess(
         }
         else
         {
-            argTypeMismatch(
-                argUse, *targetArgs.begin(), *leaf.callsite_function());
+            argTypeMismatch(argUse, parameter, *leaf.callsite_function());
         }
     }
 
-    llvm::CallBase* directCall = builder.CreateCall(
-        leaf.callsite_function(), args);
-    builder.CreateBr(bb4);
-
     llvm::Type* resultType = callInst->getFunctionType()->getReturnType();
-    if(resultType != directCall->getFunctionType()->getReturnType())
+    if(resultType != leaf.callsite_function()->getReturnType())
     {
         maybe_log_error(
             leaf.m_landing_site,
@@ -737,6 +1922,10 @@ void drti::TreenodeCompiler::reprocess(
         throw InternalCompilerError();
     }
 
+    llvm::Value* directResult = specialisedCall(builder, leaf, args);
+    llvm::BasicBlock* directBlock = builder.GetInsertBlock();
+    builder.CreateBr(bb4);
+
     if(!resultType->isVoidTy())
     {
         // Create a PHI node for the results from the two branches
@@ -745,7 +1934,7 @@ void drti::TreenodeCompiler::reprocess(
             resultType, 2, "drti_merged_result");
         // Replace any uses of the original return value with the PHI node
         callInst->replaceAllUsesWith(resultPhi);
-        resultPhi->addIncoming(directCall, bb2);
+        resultPhi->addIncoming(directResult, directBlock);
         resultPhi->addIncoming(callInst, bb3);
     }
 
@@ -754,11 +1943,230 @@ void drti::TreenodeCompiler::reprocess(
     builder.SetInsertPoint(bb4);
 }
 
+//! The first argument values that account for a significant fraction
+//! of the profiled calls, as (value, count) pairs sorted by
+//! decreasing frequency
+std::vector<std::pair<int64_t, int64_t>>
+drti::TreenodeCompiler::dominantValues() const
+{
+    const value_profile& profile(m_node->profile);
+    const int64_t samples = profile.samples;
+
+    std::vector<std::pair<int64_t, int64_t>> result;
+
+    for(int slot = 0; slot < value_profile::slots; ++slot)
+    {
+        const int64_t count = profile.counts[slot];
+        // Not worth the extra code for anything below a quarter of
+        // the calls
+        if(count && (count * 4 >= samples))
+        {
+            result.emplace_back(profile.values[slot], count);
+        }
+    }
+
+    std::sort(
+        result.begin(), result.end(),
+        [](const auto& lhs, const auto& rhs) {
+            return lhs.second > rhs.second;
+        });
+
+    return result;
+}
+
+//! Clone the function with its first argument replaced by a constant
+llvm::Function* drti::TreenodeCompiler::specialise(
+    llvm::Function* function, int64_t value)
+{
+    llvm::Argument& first(*function->arg_begin());
+
+    llvm::ValueToValueMapTy map;
+    map[&first] = llvm::ConstantInt::get(first.getType(), value, true);
+
+    // The clone has one parameter fewer than the original
+    llvm::Function* clone = llvm::CloneFunction(function, map);
+    clone->setName(function->getName() + ".drti." + llvm::Twine(value));
+    clone->setLinkage(llvm::GlobalValue::InternalLinkage);
+
+    return clone;
+}
+
+//! Generate the call to the leaf function for the fast path. If the
+//! call site was profiled this looks like
+//!
+//!   if(arg0 == value1) leaf.drti.value1(args[1...])
+//!   else if(arg0 == value2) leaf.drti.value2(args[1...])
+//!   else leaf(args...)
+//!
+//! so that the inliner gets copies of the leaf with the common values
+//! constant-folded. Returns the result of the call(s) and leaves the
+//! builder at the end of the block where they merge. An original call
+//! detached from its block serves as the generic call, if given.
+llvm::Value* drti::TreenodeCompiler::specialisedCall(
+    llvm::IRBuilder<>& builder,
+    ReflectedModule& leaf,
+    llvm::ArrayRef<llvm::Value*> args,
+    llvm::CallInst* original)
+{
+    llvm::Function* function = leaf.callsite_function();
+
+    std::vector<std::pair<int64_t, int64_t>> values(dominantValues());
+
+    if(values.empty() || args.empty() || !args[0]->getType()->isIntegerTy())
+    {
+        return builder.CreateCall(function, args);
+    }
+
+    llvm::Function* parent = builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock* before = builder.GetInsertBlock()->getNextNode();
+    llvm::BasicBlock* merge = llvm::BasicBlock::Create(
+        m_context, "drti_spec_merge", parent, before);
+
+    llvm::SmallVector<std::pair<llvm::Value*, llvm::BasicBlock*>, 5> results;
+    llvm::MDBuilder weights(m_context);
+    int64_t remaining = m_node->profile.samples;
+
+    for(const auto& [value, count]: values)
+    {
+        if(log_enabled(log_level::info))
+        {
+            log_stream()
+                << "DRTI specialising "
+                << function->getName().str()
+                << " for first argument "
+                << value
+                << " ("
+                << count
+                << " of "
+                << m_node->profile.samples
+                << " calls)\n";
+        }
+
+        llvm::Value* matches = builder.CreateICmpEQ(
+            args[0],
+            llvm::ConstantInt::get(args[0]->getType(), value, true),
+            "drti_value_matches");
+
+        llvm::BasicBlock* hit = llvm::BasicBlock::Create(
+            m_context, "drti_spec_hit", parent, merge);
+        llvm::BasicBlock* miss = llvm::BasicBlock::Create(
+            m_context, "drti_spec_miss", parent, merge);
+
+        remaining -= count;
+        builder.CreateCondBr(
+            matches, hit, miss,
+            weights.createBranchWeights(
+                count, std::max<int64_t>(remaining, 1)));
+
+        builder.SetInsertPoint(hit);
+        llvm::Value* result = builder.CreateCall(
+            specialise(function, value), args.drop_front());
+        builder.CreateBr(merge);
+        results.emplace_back(result, hit);
+
+        builder.SetInsertPoint(miss);
+    }
+
+    llvm::Value* generic = original ?
+        builder.Insert(original) : builder.CreateCall(function, args);
+    builder.CreateBr(merge);
+    results.emplace_back(generic, builder.GetInsertBlock());
+
+    builder.SetInsertPoint(merge);
+
+    if(function->getReturnType()->isVoidTy())
+    {
+        return nullptr;
+    }
+
+    llvm::PHINode* phi = builder.CreatePHI(
+        function->getReturnType(), results.size(), "drti_spec_result");
+
+    for(const auto& [result, block]: results)
+    {
+        phi->addIncoming(result, block);
+    }
+
+    return phi;
+}
+
+//! A profiled direct call to the leaf gets the same value guards as
+//! the fast path of a call via a pointer, with the original call
+//! left for the values we didn't specialise on
+void drti::TreenodeCompiler::specialiseDirect(
+    llvm::CallBase* callBase, ReflectedModule& leaf)
+{
+    // Not for invokes, which would need the guards to branch to
+    // their unwind destination too
+    auto callInst = llvm::dyn_cast<llvm::CallInst>(callBase);
+
+    if(!callInst ||
+       (callInst->getCalledFunction() != leaf.callsite_function()) ||
+       !callInst->arg_size() ||
+       !callInst->getArgOperand(0)->getType()->isIntegerTy() ||
+       dominantValues().empty())
+    {
+        return;
+    }
+
+    // The uses of the original result, before it also feeds the
+    // merged result
+    std::vector<llvm::Use*> uses;
+    for(llvm::Use& use: callInst->uses())
+    {
+        uses.push_back(&use);
+    }
+
+    llvm::SmallVector<llvm::Value*, 20> args(
+        callInst->arg_begin(), callInst->arg_end());
+
+    llvm::BasicBlock* before = callInst->getParent();
+    llvm::BasicBlock* after = before->splitBasicBlock(callInst, "drti_direct");
+    callInst->removeFromParent();
+
+    // Remove the unconditional branch inserted by splitBasicBlock
+    llvm::IRBuilder<> builder(before, before->back().eraseFromParent());
+    llvm::Value* result = specialisedCall(builder, leaf, args, callInst);
+    builder.CreateBr(after);
+
+    for(llvm::Use* use: uses)
+    {
+        use->set(result);
+    }
+}
+
+//! Whether a call happens exactly once each time its function is
+//! called, i.e. it is on every path to a return and not in a loop
+static bool calledOncePerEntry(llvm::CallBase& call)
+{
+    llvm::Function& function(*call.getFunction());
+    llvm::DominatorTree dominators(function);
+    llvm::LoopInfo loops(dominators);
+
+    if(loops.getLoopFor(call.getParent()))
+    {
+        return false;
+    }
+
+    for(llvm::BasicBlock& block: function)
+    {
+        if(llvm::isa<llvm::ReturnInst>(block.getTerminator()) &&
+           !dominators.dominates(call.getParent(), &block))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 //! For calls via a function pointer we add code to check the pointer
 //! value before using the direct call determined at runtime (fast
 //! path), and call via the pointer otherwise (slow path). Currently
-//! only handles a single call site
-void drti::TreenodeCompiler::reprocess(
+//! only handles a single call site. Returns whether the leaf is
+//! called exactly once per call of the function, which is only known
+//! for a direct call.
+bool drti::TreenodeCompiler::reprocess(
     llvm::Function* function, ReflectedModule& leaf, const static_callsite& callsite)
 {
     // TODO - handle multiple callsites. Probably our landing_site
@@ -774,9 +2182,9 @@ void drti::TreenodeCompiler::reprocess(
             if(callInst)
             {
                 llvm::Function* calledFunction(callInst->getCalledFunction());
-                if(config.log_level >= log_level::trace)
+                if(log_enabled(log_level::trace))
                 {
-                    log_stream
+                    log_stream()
                         << "DRTI "
                         << function->getName().str()
                         << " call_number "
@@ -790,14 +2198,15 @@ void drti::TreenodeCompiler::reprocess(
 
                 if(call_number == callsite.call_number)
                 {
+                    bool once = false;
                     // Currently we only need to reprocess calls via
                     // function pointers, so not those direct to a
                     // function global. TODO - optimise this ahead of time
                     if(!calledFunction)
                     {
-                        if(config.log_level >= log_level::info)
+                        if(log_enabled(log_level::info))
                         {
-                            log_stream
+                            log_stream()
                                 << "DRTI "
                                 << function->getName().str()
                                 << " call_number "
@@ -809,49 +2218,226 @@ void drti::TreenodeCompiler::reprocess(
 
                         reprocess(callInst, leaf);
                     }
-                    return;
+                    else
+                    {
+                        // The direct call always reaches the leaf. It
+                        // only needs specialising if the call site
+                        // was profiled.
+                        once = calledOncePerEntry(*callInst);
+                        specialiseDirect(callInst, leaf);
+                    }
+                    return once;
                 }
                 ++call_number;
             }
         }
     }
+    return false;
 }
 
-void drti::TreenodeCompiler::optimize()
+//! A cheap estimate of whether compiling the chain will pay off,
+//! returning the reason if not. Compilation is mostly about inlining
+//! the leaf into the caller, so it isn't worth it for a leaf that
+//! costs too much to inline for how often the call site takes this
+//! chain, or one that takes so long per call that the call itself
+//! hardly matters. compile() forces the leaf inline regardless of its
+//! cost, so this is the only size limit on it. Sets lasting to false
+//! if the chain would pass with a bigger share of the calls.
+std::string drti::TreenodeCompiler::rejection(bool& lasting)
 {
-    llvm::PassManagerBuilder pmb;
+    std::ostringstream reason;
+    lasting = true;
 
-    // We like inlining a lot. The normal default cost threshold is
-    // 225
-    pmb.Inliner = llvm::createFunctionInliningPass(1000);
-    pmb.OptLevel = 3;
+    // Only a timed chain tells us how long its calls take
+    if(m_node->location.timed && m_node->chain_calls)
+    {
+        int64_t mean_cycles = m_node->chain_cycles / m_node->chain_calls;
+        if(mean_cycles > negligible_call_cycles)
+        {
+            reason << "call overhead negligible at "
+                   << mean_cycles
+                   << " cycles per call";
+            return reason.str();
+        }
+    }
 
-    llvm::legacy::PassManager mpm;
+    // Only the calls that take this chain benefit from the inlined
+    // leaf, and the rest pay for the guard and the extra code, so the
+    // threshold scales with this chain's share of the site's calls.
+    // A shared chain serves every treenode from the call site with
+    // the same target, whatever its parent.
+    const static_callsite& site(m_node->location);
+    const int64_t site_calls = site.total_calls;
+    int64_t chain_calls = m_node->chain_calls;
+    if(compiled_chains::shareable(*m_node))
+    {
+        // No more synchronised with a thread adding a treenode than
+        // _drti_lookup_or_insert is, so a new one may not count
+        chain_calls = 0;
+        const size_t count = site.nodes.size();
+        for(size_t index = 0; index < count; ++index)
+        {
+            const treenode& node(*site.nodes[index]);
+            if(node.target == m_node->target)
+            {
+                chain_calls += node.chain_calls;
+            }
+        }
+    }
 
-    pmb.populateModulePassManager(mpm);
+    // Before the probe goes into the leaf's module, since a failure
+    // here throws
+    auto maybeTarget(
+        llvm::cantFail(llvm::orc::JITTargetMachineBuilder::detectHost())
+        .createTargetMachine());
+    CHECK_WRAPPER(site.landing, "createTargetMachine", maybeTarget);
+    std::unique_ptr<llvm::TargetMachine> target(std::move(*maybeTarget));
+
+    llvm::Function* leaf = m_leaf.callsite_function();
+
+    // Analyse a call from a throwaway function, passing its own
+    // arguments since we don't know anything about the real ones
+    llvm::Function* probe = llvm::Function::Create(
+        llvm::FunctionType::get(
+            llvm::Type::getVoidTy(m_context),
+            leaf->getFunctionType()->params(),
+            false),
+        llvm::GlobalValue::InternalLinkage,
+        "_drti_inline_probe",
+        leaf->getParent());
+
+    llvm::IRBuilder<> builder(
+        llvm::BasicBlock::Create(m_context, "entry", probe));
+    std::vector<llvm::Value*> args;
+    for(llvm::Argument& argument: probe->args())
+    {
+        args.push_back(&argument);
+    }
+    llvm::CallInst* call = builder.CreateCall(leaf, args);
+    builder.CreateRetVoid();
+
+    // The leaf typically has noinline to keep the chain intact ahead
+    // of time, which compile overrides anyway
+    const bool noinline = leaf->hasFnAttribute(llvm::Attribute::NoInline);
+    leaf->removeFnAttr(llvm::Attribute::NoInline);
+
+    std::map<llvm::Function*, std::unique_ptr<llvm::AssumptionCache>> caches;
+    std::function<llvm::AssumptionCache&(llvm::Function&)> getCache(
+        [&caches](llvm::Function& function) -> llvm::AssumptionCache& {
+            std::unique_ptr<llvm::AssumptionCache>& cache(caches[&function]);
+            if(!cache)
+            {
+                cache = std::make_unique<llvm::AssumptionCache>(function);
+            }
+            return *cache;
+        });
 
-    mpm.run(*m_caller.m_module);
+    // Cost the leaf for the host, as createJit compiles it, rather
+    // than with the DataLayout's default costs
+    llvm::TargetTransformInfo tti(target->getTargetTransformInfo(*leaf));
+    llvm::ProfileSummaryInfo psi(*leaf->getParent());
+
+    // At the full threshold, so that the cost is complete for
+    // scaling below (the analysis stops once over its threshold)
+    llvm::InlineCost cost(
+        llvm::getInlineCost(
+            *call, llvm::getInlineParams(inline_threshold), tti, getCache,
+            llvm::None, &psi));
+
+    caches.clear();
+    probe->eraseFromParent();
+    if(noinline)
+    {
+        leaf->addFnAttr(llvm::Attribute::NoInline);
+    }
 
-    llvm::legacy::FunctionPassManager fpm(m_caller.m_module);
-    pmb.populateFunctionPassManager(fpm);
+    if(cost.isNever())
+    {
+        reason << "leaf can't be inlined";
+        if(cost.getReason())
+        {
+            reason << " (" << cost.getReason() << ")";
+        }
+    }
+    else if(!cost)
+    {
+        reason << "leaf inline cost "
+               << cost.getCost()
+               << " over threshold "
+               << cost.getThreshold();
+    }
+    else if((site_calls > 0) && (chain_calls < site_calls) &&
+            (cost.getCost() >= cost.getThreshold() * chain_calls / site_calls))
+    {
+        reason << "leaf inline cost "
+               << cost.getCost()
+               << " over threshold "
+               << cost.getThreshold() * chain_calls / site_calls
+               << " for "
+               << chain_calls
+               << " of "
+               << site_calls
+               << " calls";
+        lasting = false;
+    }
 
-    // We assume that the leaf function was already optimised during
-    // ahead-of-time compilation, so there is currently not much to be
-    // gained by re-optimizing it now. It might well have been inlined
-    // and deleted by the module passes anyway
-    // fpm.run(*m_leaf.callsite_function());
-    fpm.run(*m_caller.callsite_function());
+    return reason.str();
 }
 
-void* drti::TreenodeCompiler::compile()
+void drti::TreenodeCompiler::optimize()
 {
-    llvm::orc::LLJIT& jit(*m_jit);
+    std::vector<std::string> function_names{
+        m_caller.callsite_function()->getName().str()};
+
+    // Otherwise we assume that the leaf function was already
+    // optimised during ahead-of-time compilation, so there is not
+    // much to be gained by re-optimizing it now. It might well have
+    // been inlined and deleted by the module passes anyway, so it
+    // goes by name rather than as a Function pointer
+    if(config.reoptimize)
+    {
+        function_names.push_back(m_leaf.m_landing_site.function_name);
+    }
+
+    optimizeModule(
+        *m_caller.m_module,
+        llvm::createFunctionInliningPass(inline_threshold),
+        function_names,
+        m_node->location.landing);
+}
 
+void* drti::TreenodeCompiler::compile()
+{
     llvm::Function* caller_func = m_caller.callsite_function();
 
-    if(config.log_level >= log_level::info)
+    if(config.inline_check)
     {
-        log_stream
+        CompileRejected rejected;
+        rejected.reason = rejection(rejected.lasting);
+        if(!rejected.reason.empty())
+        {
+            if(log_enabled(log_level::info))
+            {
+                log_stream()
+                    << "DRTI not inlining call from "
+                    << m_caller.m_landing_site.function_name
+                    << " to "
+                    << m_leaf.m_landing_site.function_name
+                    << ": "
+                    << rejected.reason
+                    << std::endl;
+            }
+            throw rejected;
+        }
+    }
+
+    prepare();
+
+    llvm::orc::LLJIT& jit(*m_jit);
+
+    if(log_enabled(log_level::info))
+    {
+        log_stream()
             << "DRTI attempting to inline call from "
             << m_caller.m_landing_site.function_name
             << " to "
@@ -871,15 +2457,36 @@ void* drti::TreenodeCompiler::compile()
     // before the addIRModule since that scans the module immediately
     caller_func->setLinkage(llvm::GlobalValue::ExternalLinkage);
 
+    applyBranchProfile(*caller_func, m_caller.m_landing_site);
+    applyBranchProfile(*m_leaf.callsite_function(), m_leaf.m_landing_site);
+
     // This resets the m_leaf.m_ownModule unique_ptr and redirects
     // m_leaf.m_module
     linkModules();
 
-    reprocess(caller_func, m_leaf, m_node->location);
+    const bool leaf_once = reprocess(caller_func, m_leaf, m_node->location);
+
+    if(config.host_isa)
+    {
+        retargetForHost(*m_caller.m_module);
+    }
+
+    // Calls to the compiled caller no longer reach its landing
+    // prologue, and the leaf inlined into it never had one. Rather
+    // than adding per-call bookkeeping to the fused code, the chain's
+    // one counter also counts for the leaf if every entry to the
+    // caller calls it exactly once. Otherwise these calls to the
+    // leaf go uncounted.
+    counter_t& chain_counter(counters().add(m_caller.m_landing_site));
+    if(leaf_once)
+    {
+        counters().share(m_leaf.m_landing_site, chain_counter);
+    }
+    addEntryCounter(*caller_func, chain_counter);
 
-    if(config.log_level >= log_level::trace)
+    if(log_enabled(log_level::trace))
     {
-        llvm::raw_os_ostream stream(std::cerr);
+        llvm::raw_os_ostream stream(log_stream());
         std::unique_ptr<llvm::ModulePass> printer(
             llvm::createPrintModulePass(
                 stream, "------- pre-optimize -------"));
@@ -888,24 +2495,28 @@ void* drti::TreenodeCompiler::compile()
 
     optimize();
 
-    if(config.log_level >= log_level::debug)
+    if(log_enabled(log_level::debug))
     {
-        llvm::raw_os_ostream stream(std::cerr);
+        llvm::raw_os_ostream stream(log_stream());
         std::unique_ptr<llvm::ModulePass> printer(
             llvm::createPrintModulePass(
                 stream, "------- post-optimize -------"));
         printer->runOnModule(*m_caller.m_module);
     }
 
+    defineGlobals(
+        jit, *m_caller.m_module, std::move(m_globals_map),
+        m_node->location.landing, m_near_code);
+
     llvm::Error bad = jit.addIRModule(
         llvm::orc::ThreadSafeModule(
             std::move(m_caller.m_ownModule), m_thread_safe_context));
 
     CHECK_ERROR(m_node->location.landing, "addIRModule", bad);
 
-    if(config.log_level >= log_level::trace)
+    if(log_enabled(log_level::trace))
     {
-        llvm::raw_os_ostream stream(log_stream);
+        llvm::raw_os_ostream stream(log_stream());
         std::unique_ptr<llvm::FunctionPass> printer(
             llvm::createPrintFunctionPass(
                 stream, "---- drti compiling ----"));
@@ -919,9 +2530,9 @@ void* drti::TreenodeCompiler::compile()
     CHECK_WRAPPER(m_caller.m_landing_site, "jit.lookup caller", maybeAddress);
 
     void* result = reinterpret_cast<void*>(maybeAddress->getAddress());
-    if(config.log_level >= log_level::trace)
+    if(log_enabled(log_level::trace))
     {
-        log_stream
+        log_stream()
             << "DRTI "
             << m_caller.m_landing_site.function_name
             << " compiled address "
@@ -932,12 +2543,236 @@ void* drti::TreenodeCompiler::compile()
     return result;
 }
 
+drti::RetargetCompiler::RetargetCompiler(treenode* node) :
+    m_node(node),
+    m_thread_safe_context(llvmContext()),
+    m_lock(m_thread_safe_context.getLock()),
+    m_context(*m_thread_safe_context.getContext()),
+    m_target(m_context, *m_node->landing),
+    m_near_code(useJitHeap()),
+    m_jit(createJit(*m_node->landing, m_near_code, chainRoot(m_node)))
+{
+}
+
+void* drti::RetargetCompiler::compile()
+{
+    llvm::orc::LLJIT& jit(*m_jit);
+
+    llvm::Function* function = m_target.callsite_function();
+
+    // As for the caller in TreenodeCompiler::compile
+    function->setLinkage(llvm::GlobalValue::ExternalLinkage);
+
+    applyBranchProfile(*function, m_target.m_landing_site);
+    addEntryCounter(*function, counters().add(m_target.m_landing_site));
+
+    llvm::orc::MangleAndInterner mangler(
+        jit.getExecutionSession(), jit.getDataLayout());
+
+    llvm::orc::SymbolMap globals_map;
+    m_target.globalsMap(globals_map, mangler);
+
+    retargetForHost(*m_target.m_module);
+
+    // The bitcode is already optimised, so unless asked to
+    // re-optimise for the host this only changes the instructions
+    // selected during code generation
+    if(config.reoptimize)
+    {
+        optimizeModule(
+            *m_target.m_module, nullptr,
+            {m_target.m_landing_site.function_name},
+            m_target.m_landing_site);
+    }
+
+    defineGlobals(
+        jit, *m_target.m_module, std::move(globals_map),
+        m_target.m_landing_site, m_near_code);
+
+    llvm::Error bad = jit.addIRModule(
+        llvm::orc::ThreadSafeModule(
+            std::move(m_target.m_ownModule), m_thread_safe_context));
+
+    CHECK_ERROR(m_target.m_landing_site, "addIRModule", bad);
+
+    auto maybeAddress = jit.lookup(m_target.m_landing_site.function_name);
+
+    CHECK_WRAPPER(m_target.m_landing_site, "jit.lookup target", maybeAddress);
+
+    return reinterpret_cast<void*>(maybeAddress->getAddress());
+}
+
 void drti::compile_treenode(treenode* node)
 {
-    // LEAK the entire thing to prevent cleanup of the generated
-    // machine code. TODO - save just the machine code
-    TreenodeCompiler& treenode_compiler(*new TreenodeCompiler(node));
+    compile_claim claim(node);
+    if(!claim.claimed())
+    {
+        if(log_enabled(log_level::info))
+        {
+            log_stream()
+                << "DRTI treenode "
+                << node
+                << " already being compiled by another thread\n";
+        }
+        return;
+    }
+
+    const bool shareable = compiled_chains::shareable(*node);
+    void* compiled = nullptr;
+    std::string reason;
+
+    if(shareable && chains().find(*node, compiled, reason))
+    {
+        if(!compiled)
+        {
+            if(log_enabled(log_level::info))
+            {
+                log_stream() << "DRTI treenode " << node;
+                if(reason.empty())
+                {
+                    log_stream()
+                        << " skipped since the same chain failed to compile\n";
+                }
+                else
+                {
+                    log_stream()
+                        << " skipped since the same chain was rejected: "
+                        << reason
+                        << "\n";
+                }
+            }
+            return;
+        }
+
+        if(log_enabled(log_level::info))
+        {
+            log_stream()
+                << "DRTI treenode "
+                << node
+                << " reusing compiled code "
+                << compiled
+                << "\n";
+        }
+    }
+    else
+    {
+        std::unique_ptr<TreenodeCompiler> treenode_compiler;
+
+        try
+        {
+            treenode_compiler.reset(new TreenodeCompiler(node));
+
+            compiled = treenode_compiler->compile();
+
+            // LEAK the entire thing to prevent cleanup of the generated
+            // machine code. TODO - save just the machine code
+            treenode_compiler.release();
+        }
+        catch(const CompileRejected& rejected)
+        {
+            // Rejected before creating the JIT, so there's no code to
+            // keep and the compiler gets deleted on the way out
+            if(shareable && rejected.lasting)
+            {
+                chains().add(*node, nullptr, rejected.reason);
+            }
+            throw;
+        }
+        catch(const InternalCompilerError&)
+        {
+            // The JIT may hold some code by now, so leak it as before
+            treenode_compiler.release();
+            if(shareable)
+            {
+                chains().add(*node, nullptr);
+            }
+            throw;
+        }
+
+        if(shareable)
+        {
+            chains().add(*node, compiled);
+        }
+    }
+
+    if(node->parent)
+    {
+        // Redirect function pointer to the new machine code
+        node->parent->resolved_target = compiled;
+
+        if(config.call_patching &&
+           patch_call(node->parent->location, compiled) &&
+           log_enabled(log_level::info))
+        {
+            log_stream()
+                << "DRTI "
+                << node->parent->location.landing.function_name
+                << " call_number "
+                << node->parent->location.call_number
+                << " patched to direct call "
+                << compiled
+                << std::endl;
+        }
+    }
+    else if(patch_entry(node->location.landing, compiled))
+    {
+        if(log_enabled(log_level::info))
+        {
+            log_stream()
+                << "DRTI "
+                << node->location.landing.function_name
+                << " entry point redirected to "
+                << compiled
+                << std::endl;
+        }
+    }
+}
+
+//! Several hot treenodes can share a target, which we only compile
+//! once. Retargeting is rare enough that compiling under a single
+//! lock is no hardship.
+void drti::retarget_treenode(treenode* node)
+{
+    static std::mutex mutex;
+    static std::unordered_map<const landing_site*, void*> retargeted;
 
-    // Redirect function pointer to the new machine code
-    node->parent->resolved_target = treenode_compiler.compile();
+    std::lock_guard<std::mutex> guard(mutex);
+
+    void*& compiled(retargeted[node->landing]);
+
+    if(!compiled)
+    {
+        // LEAKED like the TreenodeCompiler in compile_treenode
+        RetargetCompiler& retarget_compiler(*new RetargetCompiler(node));
+
+        compiled = retarget_compiler.compile();
+
+        if(log_enabled(log_level::info))
+        {
+            log_stream()
+                << "DRTI "
+                << node->landing->function_name
+                << " recompiled for host cpu "
+                << llvm::sys::getHostCPUName().str()
+                << " at "
+                << compiled
+                << "\n";
+        }
+    }
+
+    node->resolved_target = compiled;
+
+    if(config.call_patching &&
+       patch_call(node->location, compiled) &&
+       log_enabled(log_level::info))
+    {
+        log_stream()
+            << "DRTI "
+            << node->location.landing.function_name
+            << " call_number "
+            << node->location.call_number
+            << " patched to direct call "
+            << compiled
+            << std::endl;
+    }
 }
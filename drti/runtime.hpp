@@ -56,6 +56,16 @@ namespace drti
         void* const* globals = 0;
         //! Number of globals in the array
         size_t globals_size = 0;
+        //! Name of the file holding the bitcode if the module was
+        //! decorated with DRTI_BITCODE_FILE, in which case module is
+        //! nullptr. A relative name is in the directory of the binary
+        //! containing this reflect.
+        const char* side_file = 0;
+        //! Offset of the bitcode within the side file
+        uint64_t side_offset = 0;
+        //! xxHash64 of the bitcode, checked when the side file is
+        //! first mapped
+        uint64_t side_hash = 0;
     };
 
     //! Function entry point accounting
@@ -69,10 +79,40 @@ namespace drti
         const char* function_name = 0;
         //! Link to the bitcode for the containing module
         reflect* self = nullptr;
+        //! Entry point of the function if it was decorated with a
+        //! patchable prologue (see DRTI_ENTRY_PREFIX_BYTES) otherwise
+        //! nullptr
+        void* patchable_entry = nullptr;
+        //! Execution counts for the two outgoing edges of each
+        //! conditional branch in the function, if it was decorated
+        //! with DRTI_PROFILE_BRANCHES, otherwise nullptr. The
+        //! branches are numbered by visit_conditional_branches.
+        int64_t* branch_counts = nullptr;
+        //! Number of conditional branches counted
+        size_t branches = 0;
+        //! Entry point of the function, so the runtime can tell
+        //! whether a thunk jumps straight to it
+        const void* entry = nullptr;
     };
 
     struct treenode;
 
+    //! Histogram of the most frequent values of the first argument
+    //! passed from a profiled call site
+    struct value_profile
+    {
+        static constexpr int slots = 4;
+
+        //! Total number of values recorded
+        counter_t samples = 0;
+        //! Number of values that didn't fit in the histogram
+        counter_t others = 0;
+        //! Distinct values, in order of first appearance
+        int64_t values[slots];
+        //! Number of times each value was seen (zero for unused slots)
+        counter_t counts[slots];
+    };
+
     //! Static information about a call site, i.e. unique to the calling
     //! location
     //! TODO - for initialisation order safety we need this to be statically initialisable
@@ -90,6 +130,16 @@ namespace drti
         unsigned call_number;
         //! Node for each call chain passing through this call site.
         std::vector<std::unique_ptr<treenode>> nodes;
+        //! True if the call is direct to a named function rather than
+        //! via a function pointer, so the target can never change
+        bool fixed_target = false;
+        //! True if the call site was decorated with DRTI_TIME_CALLS,
+        //! so its chains are judged by chain_cycles rather than
+        //! chain_calls
+        bool timed = false;
+        //! The return address of the call instruction, recorded by
+        //! the first decorated function to land from here
+        const void* return_address = nullptr;
     };
 
     //! A node in a call tree, representing one (parent, target) pair
@@ -115,13 +165,56 @@ namespace drti
         //! theory it would be possible for one target address to arrive
         //! at different landing sites, if the call goes via a thunk that
         //! can change destination. Does that actually exist in practice?
+        //! A fixed this-adjusting thunk for a secondary base class
+        //! is fine: it jumps to the real function, which lands with
+        //! our treenode, and the runtime decodes the adjustment (see
+        //! resolve_thunk in patching.hpp).
         landing_site* landing;
+        //! First argument values for this chain, only recorded if the
+        //! call site was decorated for profiling
+        value_profile profile;
+        //! Estimated TSC cycles spent in calls along this chain, only
+        //! recorded if the call site was decorated for timing. Every
+        //! timing_interval'th call is measured and counts for that
+        //! many calls.
+        counter_t chain_cycles = 0;
     };
 
     //! Called by the client for treenodes that may be of interest.
     //! At the moment this attempts to compile the functions in the
     //! call chain immediately.
     DRTI_PUBLIC void inspect_treenode(treenode*);
+
+    //! Called by the client when the chain_calls of a treenode with a
+    //! decorated target reaches hot_chain_calls (or its chain_cycles
+    //! reaches hot_chain_cycles, for a timed call site). With
+    //! DRTI_HOST_ISA this recompiles the target for the host CPU.
+    DRTI_PUBLIC void hot_treenode(treenode*);
+
+    //! Called by the static constructor of each decorated module so
+    //! that runtime compilation can link in function definitions from
+    //! modules other than those of the caller and the leaf.
+    DRTI_PUBLIC void register_module(reflect*);
+
+    //! The number of times a landing site's function has been
+    //! entered, including entries to compiled versions of it, which
+    //! count in place of total_called
+    DRTI_PUBLIC int64_t landing_total(const landing_site&);
+
+    //! The number of conditional branches in compiled code so far
+    //! that were given weights from DRTI_PROFILE_BRANCHES counts. For
+    //! tests and diagnostics.
+    DRTI_PUBLIC int64_t weighted_branches();
+
+    //! The landing site of the named (mangled) function if any
+    //! compiled code counts entries to it, otherwise nullptr. For
+    //! tests and diagnostics.
+    DRTI_PUBLIC const landing_site* counted_landing_site(
+        const char* function_name);
+
+    //! Change the DRTI log level (see log_level in logging.hpp and
+    //! DRTI_LOG_LEVEL) returning the previous one
+    DRTI_PUBLIC int set_log_level(int);
 }
 
 #endif // runtime_rmg_20191125_included
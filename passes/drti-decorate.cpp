@@ -26,28 +26,43 @@
 #include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/IRPrintingPasses.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Linker/Linker.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/xxhash.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 #include <drti/runtime.hpp>
 #include <drti/drti-common.hpp>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <fstream>
 #include <istream>
 #include <sstream>
+#include <tuple>
 #include <unordered_set>
 
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 // These are generated by objcopy from bitcode
 extern const char _binary_drti_inline_bc_start[];
 extern const char _binary_drti_inline_bc_end[];
@@ -114,13 +129,21 @@ namespace drti
         llvm::StructType* m_drti_callsite_type;
         llvm::StructType* m_drti_treenode_type;
         llvm::StructType* m_drti_reflect_type;
-        llvm::Function* m_drti_landed;
+        llvm::Function* m_drti_landing_slow_path;
         llvm::Function* m_drti_call_from;
+        llvm::Function* m_drti_call_from_profiled;
+        llvm::Function* m_drti_call_from_timed;
+        llvm::Function* m_drti_timing_start;
+        llvm::Function* m_drti_timing_end;
+        llvm::Function* m_drti_register_module;
     };
 
     class DecoratePass
     {
     public:
+        //! How much debug info to keep in the embedded bitcode
+        enum class bitcode_debug { full, lines, none };
+
         DecoratePass(llvm::Module& module);
 
         //! Find any target functions
@@ -133,20 +156,36 @@ namespace drti
 
         void create_self();
         void add_landing_globals();
-        llvm::GlobalVariable* create_landing_global(llvm::Function* const);
+        //! Add a static constructor registering our reflect global
+        //! with the runtime
+        void add_registration();
+        llvm::GlobalVariable* create_landing_global(
+            llvm::Function* const,
+            llvm::GlobalVariable* branch_counts,
+            size_t branches);
         llvm::GlobalVariable* create_callsite_global(
             llvm::Function* const,
             llvm::GlobalVariable* landing_global,
-            unsigned call_number);
+            unsigned call_number,
+            bool fixed_target,
+            bool timed);
 
     private:
         llvm::SmallVector<llvm::GlobalValue*, 10> collect_globals();
         llvm::SmallVector<char, 0> raw_bitcode();
+        uint64_t append_side_file(llvm::ArrayRef<char> bitcode);
 
         llvm::Value* add_landing_update(
             llvm::Function*, llvm::GlobalVariable*);
+        void add_patchable_entry(llvm::Function*);
+        std::vector<llvm::BranchInst*> collect_branches(llvm::Function*);
+        llvm::GlobalVariable* create_branch_counts_global(
+            llvm::Function*, size_t branches);
+        void count_branches(
+            const std::vector<llvm::BranchInst*>&, llvm::GlobalVariable*);
         void decorate_call(
-            llvm::Value*, llvm::CallBase*, llvm::GlobalVariable*);
+            llvm::Value*, llvm::CallBase*, llvm::GlobalVariable*,
+            bool profile_arguments, bool timed);
 
         std::vector<std::pair<unsigned, llvm::CallBase*>> collect_calls(
             llvm::Function* function);
@@ -156,12 +195,21 @@ namespace drti
             llvm::Value*, llvm::GlobalVariable*);
 
         static std::unordered_set<std::string> targets_from_environment();
+        static std::unordered_set<std::string> names_from_environment(
+            const char* name);
         static void split_stream(std::istream&, std::unordered_set<std::string>&);
+        static bool flag_from_environment(const char* name);
+        static bitcode_debug bitcode_debug_from_environment();
+        static bool is_std_function_thunk(const llvm::Function&);
+        static bool is_std_function_invoker_type(const llvm::Type*);
 
         //! The names of functions we want to decorate for landing
         //! purposes, as well as the names of call targets that we
         //! decorate from within those targets.
         std::unordered_set<std::string> m_target_function_names;
+        //! The names of target functions whose decorated calls also
+        //! record the value of the first (integer) argument
+        std::unordered_set<std::string> m_profile_function_names;
         llvm::Module& m_module;
         //! Function declarations and definitions in this module from
         //! our set of target names
@@ -172,6 +220,24 @@ namespace drti
         llvm::DenseSet<llvm::Type*> m_target_function_types;
         std::optional<InlineHelpers> m_inline;
         llvm::GlobalVariable* m_reflect_global;
+        //! Emit prefix data and a hot-patchable first instruction so
+        //! the runtime can redirect the function entry point
+        bool m_patchable_entry;
+        //! Count the edges taken from conditional branches in target
+        //! functions, for the runtime to use as branch weights
+        bool m_profile_branches;
+        //! Sample the TSC cycles taken by decorated calls, so the
+        //! runtime can pick chains by time rather than call count
+        bool m_time_calls;
+        //! Decorate libstdc++'s std::function invokers implicitly, and
+        //! calls via pointers of their type
+        bool m_std_function;
+        //! Debug info in the bitcode we embed for the runtime, which
+        //! doesn't affect the object code for the module itself
+        bitcode_debug m_bitcode_debug;
+        //! Side file to append the bitcode to instead of embedding
+        //! it, if not empty
+        std::string m_bitcode_file;
     };
 };
 
@@ -220,13 +286,127 @@ std::unordered_set<std::string> drti::DecoratePass::targets_from_environment()
     return result;
 }
 
+std::unordered_set<std::string> drti::DecoratePass::names_from_environment(
+    const char* name)
+{
+    std::unordered_set<std::string> result;
+
+    const char* names = getenv(name);
+    if(names)
+    {
+        DEBUG_WITH_TYPE(
+            "drti", llvm::dbgs() << "drti: parsing " << name << " environment variable\n");
+        std::istringstream stream{std::string(names)};
+        split_stream(stream, result);
+    }
+
+    return result;
+}
+
+bool drti::DecoratePass::flag_from_environment(const char* name)
+{
+    const char* value = getenv(name);
+    return value && *value && (std::string(value) != "0");
+}
+
+drti::DecoratePass::bitcode_debug
+drti::DecoratePass::bitcode_debug_from_environment()
+{
+    const char* value = getenv("DRTI_BITCODE_DEBUG");
+    if(!value || !*value || (std::string(value) == "full"))
+    {
+        return bitcode_debug::full;
+    }
+    else if(std::string(value) == "lines")
+    {
+        return bitcode_debug::lines;
+    }
+    else if(std::string(value) == "none")
+    {
+        return bitcode_debug::none;
+    }
+    else
+    {
+        llvm::report_fatal_error(
+            "DRTI_BITCODE_DEBUG should be one of full, lines or none");
+    }
+}
+
+// A call via libstdc++'s std::function goes through
+// std::function<R(Args...)>::operator() (usually inlined) and then
+// via the _M_invoker pointer to
+// std::_Function_handler<R(Args...), Functor>::_M_invoke, which
+// calls the stored callable. Nobody can list these in the targets
+// file, so with DRTI_STD_FUNCTION we decorate them implicitly to keep
+// the chain from the caller to the callable intact.
+bool drti::DecoratePass::is_std_function_thunk(const llvm::Function& function)
+{
+    const llvm::StringRef name(function.getName());
+
+    if(name.startswith("_ZNSt17_Function_handlerI") &&
+       name.contains("E9_M_invokeERKSt9_Any_data"))
+    {
+        return is_std_function_invoker_type(function.getFunctionType());
+    }
+    else
+    {
+        return
+            name.startswith("_ZNKSt8functionI") && name.contains("EEclE");
+    }
+}
+
+bool drti::DecoratePass::is_std_function_invoker_type(const llvm::Type* type)
+{
+    // R (const std::_Any_data&, Args&&...)
+    auto function_type = llvm::dyn_cast<llvm::FunctionType>(type);
+    if(!function_type || (function_type->getNumParams() == 0))
+    {
+        return false;
+    }
+
+    auto pointer = llvm::dyn_cast<llvm::PointerType>(
+        function_type->getParamType(0));
+    if(!pointer)
+    {
+        return false;
+    }
+
+    auto any_data = llvm::dyn_cast<llvm::StructType>(
+        pointer->getElementType());
+
+    if(!any_data || !any_data->hasName())
+    {
+        return false;
+    }
+
+    // Linking modules (e.g. for whole-program decoration) can rename
+    // the type with a numeric suffix
+    llvm::StringRef name(any_data->getName());
+    llvm::StringRef base, suffix;
+    std::tie(base, suffix) = name.rsplit('.');
+    if(!suffix.empty() &&
+       (suffix.find_first_not_of("0123456789") == llvm::StringRef::npos))
+    {
+        name = base;
+    }
+
+    return name == "union.std::_Any_data";
+}
+
 drti::DecoratePass::DecoratePass(llvm::Module& module) :
     m_target_function_names(targets_from_environment()),
+    m_profile_function_names(names_from_environment("DRTI_PROFILE_ARGUMENTS")),
     m_module(module),
     m_target_functions(),
     m_target_function_types(),
     m_inline(),
-    m_reflect_global(nullptr)
+    m_reflect_global(nullptr),
+    m_patchable_entry(flag_from_environment("DRTI_PATCHABLE_ENTRY")),
+    m_profile_branches(flag_from_environment("DRTI_PROFILE_BRANCHES")),
+    m_time_calls(flag_from_environment("DRTI_TIME_CALLS")),
+    m_std_function(flag_from_environment("DRTI_STD_FUNCTION")),
+    m_bitcode_debug(bitcode_debug_from_environment()),
+    m_bitcode_file(getenv("DRTI_BITCODE_FILE") ? getenv("DRTI_BITCODE_FILE") : "")
 {
 }
 
@@ -275,8 +455,9 @@ bool drti::DecoratePass::find_target_functions()
 {
     for(llvm::Function& function: m_module.functions())
     {
-        if(m_target_function_names.find(function.getName().str()) !=
-           m_target_function_names.end())
+        if((m_target_function_names.find(function.getName().str()) !=
+            m_target_function_names.end()) ||
+           (m_std_function && is_std_function_thunk(function)))
         {
             if(!function.isDeclaration())
             {
@@ -348,10 +529,20 @@ drti::InlineHelpers::InlineHelpers(llvm::Module& module) :
         module.getTypeByName("struct.drti::treenode")),
     m_drti_reflect_type(
         module.getTypeByName("struct.drti::reflect")),
-    m_drti_landed(
-        module.getFunction("_drti_landed")),
+    m_drti_landing_slow_path(
+        module.getFunction("_drti_landing_slow_path")),
     m_drti_call_from(
-        module.getFunction("_drti_call_from"))
+        module.getFunction("_drti_call_from")),
+    m_drti_call_from_profiled(
+        module.getFunction("_drti_call_from_profiled")),
+    m_drti_call_from_timed(
+        module.getFunction("_drti_call_from_timed")),
+    m_drti_timing_start(
+        module.getFunction("_drti_timing_start")),
+    m_drti_timing_end(
+        module.getFunction("_drti_timing_end")),
+    m_drti_register_module(
+        module.getFunction("_drti_register_module"))
 {
     // Check that the compile-time structure types in tree.hpp haven't
     // changed since we hard-coded their setup here
@@ -359,11 +550,18 @@ drti::InlineHelpers::InlineHelpers(llvm::Module& module) :
     CHECK_MEMBER_P(reflect, module_size, size_t, module);
     CHECK_MEMBER_P(reflect, globals, void* const*, module_size);
     CHECK_MEMBER_P(reflect, globals_size, size_t, globals);
+    CHECK_MEMBER_P(reflect, side_file, const char*, globals_size);
+    CHECK_MEMBER_P(reflect, side_offset, uint64_t, side_file);
+    CHECK_MEMBER_P(reflect, side_hash, uint64_t, side_offset);
 
     CHECK_MEMBER(landing_site, total_called, counter_t, 0);
     CHECK_MEMBER_P(landing_site, global_name, const char*, total_called);
     CHECK_MEMBER_P(landing_site, function_name, const char*, global_name);
     CHECK_MEMBER_P(landing_site, self, reflect*, function_name);
+    CHECK_MEMBER_P(landing_site, patchable_entry, void*, self);
+    CHECK_MEMBER_P(landing_site, branch_counts, int64_t*, patchable_entry);
+    CHECK_MEMBER_P(landing_site, branches, size_t, branch_counts);
+    CHECK_MEMBER_P(landing_site, entry, const void*, branches);
 }
 
 bool drti::InlineHelpers::ok() const
@@ -377,7 +575,13 @@ bool drti::InlineHelpers::ok() const
             "drti", llvm::dbgs() << "drti: type(s) not found in module\n");
         return false;
     }
-    else if (!m_drti_landed || !m_drti_call_from)
+    else if (!m_drti_landing_slow_path ||
+             !m_drti_call_from ||
+             !m_drti_call_from_profiled ||
+             !m_drti_call_from_timed ||
+             !m_drti_timing_start ||
+             !m_drti_timing_end ||
+             !m_drti_register_module)
     {
         DEBUG_WITH_TYPE(
             "drti", llvm::dbgs() << "drti: support function(s) not found in module\n");
@@ -398,9 +602,27 @@ bool drti::DecoratePass::lookup_helpers()
 
 llvm::SmallVector<char, 0> drti::DecoratePass::raw_bitcode()
 {
+    // Debug info can easily be most of the bitcode, and the runtime
+    // has to parse all of it, so we can strip it from a copy of the
+    // module. Cloning keeps the globals in the same order, so they
+    // still match collect_globals.
+    std::unique_ptr<llvm::Module> stripped;
+    if(m_bitcode_debug != bitcode_debug::full)
+    {
+        stripped = llvm::CloneModule(m_module);
+        if(m_bitcode_debug == bitcode_debug::lines)
+        {
+            llvm::stripNonLineTableDebugInfo(*stripped);
+        }
+        else
+        {
+            llvm::StripDebugInfo(*stripped);
+        }
+    }
+
     llvm::SmallVector<char, 0> buffer;
     llvm::BitcodeWriter writer(buffer);
-    writer.writeModule(m_module);
+    writer.writeModule(stripped ? *stripped : m_module);
     writer.writeStrtab();
     return buffer;
 }
@@ -413,24 +635,50 @@ void drti::DecoratePass::create_self()
 
     // Dump the module as bitcode in its current state (before actual
     // decoration) and save this in a global variable in the module so
-    // it can be deserialized at runtime.
+    // it can be deserialized at runtime. Alternatively append it to
+    // the side file and just record where it is.
     llvm::SmallVector<char, 0> buffer = raw_bitcode();
-    llvm::Constant* as_constant(
-        llvm::ConstantDataArray::get(
-            m_module.getContext(),
-            llvm::makeArrayRef(
-                buffer.data(), buffer.size())));
-
-    auto bitcode_global = new llvm::GlobalVariable(
-        m_module,
-        as_constant->getType(), true, llvm::GlobalValue::InternalLinkage,
-        as_constant, "__drti_bitcode");
 
     llvm::PointerType* void_star = llvm::IntegerType::get(
         m_module.getContext(), 8)->getPointerTo();
+    llvm::IntegerType* int64_type = llvm::IntegerType::get(
+        m_module.getContext(), 64);
+
+    llvm::Constant* cast_bitcode = llvm::ConstantPointerNull::get(void_star);
+    llvm::Constant* cast_side_file = llvm::ConstantPointerNull::get(void_star);
+    uint64_t side_offset = 0;
+    uint64_t side_hash = 0;
+
+    if(m_bitcode_file.empty())
+    {
+        llvm::Constant* as_constant(
+            llvm::ConstantDataArray::get(
+                m_module.getContext(),
+                llvm::makeArrayRef(
+                    buffer.data(), buffer.size())));
+
+        auto bitcode_global = new llvm::GlobalVariable(
+            m_module,
+            as_constant->getType(), true, llvm::GlobalValue::InternalLinkage,
+            as_constant, "__drti_bitcode");
+
+        cast_bitcode = llvm::ConstantExpr::getBitCast(bitcode_global, void_star);
+    }
+    else
+    {
+        side_offset = append_side_file(buffer);
+        side_hash = llvm::xxHash64(llvm::StringRef(buffer.data(), buffer.size()));
 
-    llvm::Constant* cast_bitcode = llvm::ConstantExpr::getBitCast(
-        bitcode_global, void_star);
+        llvm::Constant* name_initializer = llvm::ConstantDataArray::getString(
+            m_module.getContext(), m_bitcode_file);
+
+        auto name_global = new llvm::GlobalVariable(
+            m_module,
+            name_initializer->getType(), true, llvm::GlobalValue::InternalLinkage,
+            name_initializer, "__drti_side_file");
+
+        cast_side_file = llvm::ConstantExpr::getBitCast(name_global, void_star);
+    }
 
     // Create void* pointers for all the globals (variables and functions)
     llvm::SmallVector<llvm::Constant*, 0> extern_addresses;
@@ -456,15 +704,14 @@ void drti::DecoratePass::create_self()
     llvm::Constant* cast_globals = llvm::ConstantExpr::getBitCast(
         globals_variable, void_star->getPointerTo());
 
-    llvm::Constant* reflect_members[4] = {
+    llvm::Constant* reflect_members[7] = {
         cast_bitcode,
-        llvm::ConstantInt::get(
-            llvm::IntegerType::get(
-                m_module.getContext(), 64), buffer.size()),
+        llvm::ConstantInt::get(int64_type, buffer.size()),
         cast_globals,
-        llvm::ConstantInt::get(
-            llvm::IntegerType::get(
-                m_module.getContext(), 64), extern_addresses.size()),
+        llvm::ConstantInt::get(int64_type, extern_addresses.size()),
+        cast_side_file,
+        llvm::ConstantInt::get(int64_type, side_offset),
+        llvm::ConstantInt::get(int64_type, side_hash),
     };
 
     llvm::Constant* reflect_constant =
@@ -481,6 +728,85 @@ void drti::DecoratePass::create_self()
         << buffer.size() << "\n");
 }
 
+//! Append to the side file under an exclusive lock, since several
+//! modules can be compiled in parallel, returning the offset of the
+//! bitcode within the file. If the file already holds an identical
+//! copy, e.g. from rebuilding an unchanged module, that gets reused
+//! instead, so that rebuilds don't keep growing the file.
+uint64_t drti::DecoratePass::append_side_file(llvm::ArrayRef<char> bitcode)
+{
+    int fd = open(m_bitcode_file.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+
+    struct stat status;
+
+    if((fd < 0) || (flock(fd, LOCK_EX) != 0) || (fstat(fd, &status) != 0))
+    {
+        llvm::report_fatal_error(
+            "DRTI_BITCODE_FILE " + m_bitcode_file + ": " + strerror(errno));
+    }
+
+    if(status.st_size >= static_cast<off_t>(bitcode.size()))
+    {
+        void* address = mmap(
+            nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(address == MAP_FAILED)
+        {
+            llvm::report_fatal_error(
+                "DRTI_BITCODE_FILE " + m_bitcode_file + ": " + strerror(errno));
+        }
+
+        const char* begin = static_cast<const char*>(address);
+        const char* end = begin + status.st_size;
+        const char* found = std::search(
+            begin, end, bitcode.begin(), bitcode.end());
+        munmap(address, status.st_size);
+
+        if(found != end)
+        {
+            // Also releases the lock
+            close(fd);
+
+            DEBUG_WITH_TYPE(
+                "drti",
+                llvm::dbgs() << "drti: reusing " << bitcode.size()
+                << " bytes of bitcode in " << m_bitcode_file
+                << " at offset " << (found - begin) << "\n");
+
+            return found - begin;
+        }
+    }
+
+    const char* next = bitcode.data();
+    size_t remaining = bitcode.size();
+
+    while(remaining)
+    {
+        ssize_t written = write(fd, next, remaining);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            llvm::report_fatal_error(
+                "DRTI_BITCODE_FILE " + m_bitcode_file + ": " + strerror(errno));
+        }
+        next += written;
+        remaining -= written;
+    }
+
+    // Also releases the lock
+    close(fd);
+
+    DEBUG_WITH_TYPE(
+        "drti",
+        llvm::dbgs() << "drti: appended " << bitcode.size()
+        << " bytes of bitcode to " << m_bitcode_file
+        << " at offset " << status.st_size << "\n");
+
+    return status.st_size;
+}
+
 llvm::Value* drti::DecoratePass::add_landing_update(
     llvm::Function* function,
     llvm::GlobalVariable* landing_global)
@@ -492,24 +818,25 @@ llvm::Value* drti::DecoratePass::add_landing_update(
     // We arrive at code like this:
     // entry:
     //    alloca instruction(s)
+    //    treenode = _drti_caller()
     //    drtiRetAddress = __builtin_return_address(0)
     //    aligned = (drtiRetAddress % (DRTI_RETALIGN - 1)) == 0
-    //    br i1 aligned, drti_land2, drti_land1
+    //    br i1 aligned, drti_land2, drti_land1 (unlikely)
     //
     // drti_land1:
-    //    caller = phi [ nullptr, entry ], [ nullptr, drti_land2 ], [ treenode, drti_land3 ]
+    //    caller = phi [ nullptr, entry ], [ landed, drti_land2 ]
     //    original entry terminator
     //    <remaining function body>
     //
     // drti_land2:
-    //    maybe_magic = ((const uint64_t*)drtiRetAddress)[-DRTI_RETALIGN / 8]
-    //    has_magic = maybe_magic == DRTI_MAGIC
-    //    br i1 has_magic drti_land3, drti_land1
-    //
-    // drti_land3:
-    //    treenode = _drti_caller()
-    //    call _drti_landed(landing_global, treenode)
+    //    landed = _drti_landing_slow_path(landing_global, treenode, drtiRetAddress)
     //    br drti_land1
+    //
+    // The magic number check and the call to _drti_landed are out of
+    // line in _drti_landing_slow_path, which lives in .text.unlikely,
+    // so the hot path is just the alignment test and a fall-through.
+    // The _drti_caller pseudo-call stays here since it reads the
+    // treenode from a register on entry (see drti-target.cpp).
 
     llvm::BasicBlock* entryBlock = &function->getEntryBlock();
     llvm::Instruction* splitPoint = entryBlock->getTerminator();
@@ -532,13 +859,19 @@ llvm::Value* drti::DecoratePass::add_landing_update(
         splitPoint, "drti_land1");
     llvm::BasicBlock* land2 = llvm::BasicBlock::Create(
         m_module.getContext(), "drti_land2", function, nullptr);
-    llvm::BasicBlock* land3 = llvm::BasicBlock::Create(
-        m_module.getContext(), "drti_land3", function, nullptr);
 
     // Remove the unconditional branch inserted by splitBasicBlock
     llvm::IRBuilder<> builder(
         entryBlock, entryBlock->back().eraseFromParent());
 
+    //    treenode = _drti_caller()
+    llvm::PointerType* treenode_pointer_type =
+        m_inline->m_drti_treenode_type->getPointerTo();
+    llvm::FunctionCallee drtiCaller(
+        m_module.getOrInsertFunction("_drti_caller", treenode_pointer_type));
+    llvm::Value* treenode = builder.CreateCall(
+        drtiCaller, llvm::None, "drtiTreenode");
+
     //    drtiRetAddress = __builtin_return_address(0)
     //    aligned = (drtiRetAddress % (DRTI_RETALIGN - 1)) == 0
     //    br i1 aligned, drti_land2, drti_land1
@@ -553,6 +886,7 @@ llvm::Value* drti::DecoratePass::add_landing_update(
         "llvm.returnaddress", voidpType, zero32->getType());
     llvm::Value* returnAddress = builder.CreateCall(
         builtinRet, zeroArg, "drtiRetAddress");
+    llvm::Value* returnAddressPointer = returnAddress;
 
     llvm::Constant* drtiRetAlign = llvm::ConstantInt::get(
         llvm::IntegerType::get(m_module.getContext(), 64), DRTI_RETALIGN - 1);
@@ -563,71 +897,96 @@ llvm::Value* drti::DecoratePass::add_landing_update(
         returnAddress, drtiRetAlign, "drtiAndRetalign");
 
     llvm::Value* isZero = builder.CreateICmpEQ(mod, zero64, "drtiRetIsAligned");
-    builder.CreateCondBr(isZero, land2, land1);
+
+    // The same odds as __builtin_expect, so that block placement
+    // keeps the fall-through on the hot path
+    llvm::MDBuilder weights(m_module.getContext());
+    builder.CreateCondBr(
+        isZero, land2, land1, weights.createBranchWeights(1, 2000));
 
     // drti_land1:
-    //    caller = phi [ nullptr, entry ], [ nullptr, drti_land2 ], [ treenode, drti_land3 ]
+    //    caller = phi [ nullptr, entry ], [ landed, drti_land2 ]
     builder.SetInsertPoint(land1, land1->begin());
-    llvm::PointerType* treenode_pointer_type =
-        m_inline->m_drti_treenode_type->getPointerTo();
     llvm::Constant* null_treenode_pointer = llvm::ConstantPointerNull::get(
         treenode_pointer_type);
     llvm::PHINode* caller = builder.CreatePHI(
-        treenode_pointer_type, 3, "drtiCallerTreenode");
+        treenode_pointer_type, 2, "drtiCallerTreenode");
 
     // drti_land2:
-    //    maybe_magic = ((const uint64_t*)drtiRetAddress)[-DRTI_RETALIGN / 8]
-    //    has_magic = maybe_magic == DRTI_MAGIC
-    //    br i1 has_magic drti_land3, drti_land1
-    builder.SetInsertPoint(land2);
-    llvm::Type* ptr_int64_t =
-        llvm::IntegerType::get(m_module.getContext(), 64)->getPointerTo();
-    llvm::Value* returnAddressCast = builder.CreateIntToPtr(
-        returnAddress, ptr_int64_t, "drtiRetAddressCast");
-    static_assert(DRTI_RETALIGN % sizeof(int64_t) == 0, "Invalid DRTI_RETALIGN");
-    llvm::Value* indexes[] = {
-        llvm::ConstantInt::get(
-            llvm::IntegerType::get(m_module.getContext(), 64),
-            -DRTI_RETALIGN / sizeof(int64_t))
-    };
-    llvm::Value* gep = builder.CreateGEP(returnAddressCast, indexes, "drtiGep");
-    llvm::Value* maybeMagic = builder.CreateLoad(gep, "drtiMaybeMagic");
-    llvm::Constant* magic = llvm::ConstantInt::get(
-        llvm::IntegerType::get(m_module.getContext(), 64), DRTI_MAGIC);
-    llvm::Value* matches = builder.CreateICmpEQ(maybeMagic, magic, "drtiMatches");
-    builder.CreateCondBr(matches, land3, land1);
-
-    // drti_land3:
-    //    call _drti_landed(landing_global, _drti_caller())
+    //    landed = _drti_landing_slow_path(landing_global, treenode, drtiRetAddress)
     //    br drti_land1
-    builder.SetInsertPoint(land3);
-    llvm::FunctionCallee drtiCaller(
-        m_module.getOrInsertFunction("_drti_caller", treenode_pointer_type));
-    llvm::Value* treenode = builder.CreateCall(
-        drtiCaller, llvm::None, "drtiTreenode");
+    builder.SetInsertPoint(land2);
 
-    llvm::Value* arguments[] = { landing_global, treenode };
+    llvm::Value* arguments[] = {
+        landing_global, treenode, returnAddressPointer };
 
     DEBUG_WITH_TYPE(
         "drti",
         llvm::dbgs()
-        << "drti: adding call to " << m_inline->m_drti_landed->getName()
+        << "drti: adding call to " << m_inline->m_drti_landing_slow_path->getName()
         << " from " << function->getName() << "\n");
 
-    builder.CreateCall(m_inline->m_drti_landed, arguments);
+    llvm::Value* landed = builder.CreateCall(
+        m_inline->m_drti_landing_slow_path, arguments, "drtiLanded");
     builder.CreateBr(land1);
 
     caller->addIncoming(null_treenode_pointer, entryBlock);
-    caller->addIncoming(null_treenode_pointer, land2);
-    caller->addIncoming(treenode, land3);
+    caller->addIncoming(landed, land2);
 
     return caller;
 }
 
+void drti::DecoratePass::add_patchable_entry(llvm::Function* function)
+{
+    // Place an indirect jump in the prefix data immediately before
+    // the entry point, with its (initially null) absolute target
+    // address in front of it:
+    //
+    //   entry-16:  .8byte 0            ; redirect address
+    //   entry-8:   jmp *-14(%rip)      ; i.e. via entry-16
+    //   entry-2:   int3; int3
+    //   entry:     <first instruction, at least two bytes>
+    //
+    // The runtime redirects the function by storing the address and
+    // then atomically replacing the first two bytes of the function
+    // with "jmp entry-8". This is safe for concurrent callers because
+    // it is a single aligned two-byte store on an instruction
+    // boundary and the prefix itself is never executed beforehand.
+    static_assert(DRTI_ENTRY_PREFIX_BYTES == 16, "Prefix layout mismatch");
+
+    const uint8_t prefix[DRTI_ENTRY_PREFIX_BYTES] = {
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0xff, 0x25, 0xf2, 0xff, 0xff, 0xff,
+        0xcc, 0xcc
+    };
+
+    function->setPrefixData(
+        llvm::ConstantDataArray::get(
+            m_module.getContext(), llvm::makeArrayRef(prefix)));
+
+    // Keeps the address slot naturally aligned and puts the entry
+    // point on a boundary that makes the two-byte store atomic
+    if(function->getAlignment() < DRTI_ENTRY_PREFIX_BYTES)
+    {
+        function->setAlignment(DRTI_ENTRY_PREFIX_BYTES);
+    }
+
+    // Guarantees a first instruction of at least two bytes (see
+    // PatchableFunction.cpp)
+    function->addFnAttr("patchable-function", "prologue-short-redirect");
+
+    DEBUG_WITH_TYPE(
+        "drti",
+        llvm::dbgs() << "drti: patchable entry for "
+        << function->getName() << "\n");
+}
+
 void drti::DecoratePass::decorate_call(
     llvm::Value* caller,
     llvm::CallBase* callInst,
-    llvm::GlobalVariable* callsite)
+    llvm::GlobalVariable* callsite,
+    bool profile_arguments,
+    bool timed)
 {
     // Insert new code before the original call
     llvm::IRBuilder<> builder(callInst);
@@ -639,12 +998,44 @@ void drti::DecoratePass::decorate_call(
         llvm::IntegerType::get(m_module.getContext(), 8)->getPointerTo(),
         "castOldTarget");
 
-    llvm::Value* callFromArgs[] = {
-        callsite, caller, oldTarget
-    };
+    llvm::Value* treenode = nullptr;
 
-    llvm::Value* treenode = builder.CreateCall(
-        m_inline->m_drti_call_from, callFromArgs, "treenode");
+    if(profile_arguments &&
+       (callInst->arg_size() > 0) &&
+       callInst->getArgOperand(0)->getType()->isIntegerTy())
+    {
+        // Record the first argument value so the runtime can
+        // generate specialised versions of the inlined target
+        llvm::Value* value = builder.CreateSExtOrTrunc(
+            callInst->getArgOperand(0),
+            llvm::IntegerType::get(m_module.getContext(), 64),
+            "profiledValue");
+
+        llvm::Value* callFromArgs[] = {
+            callsite, caller, oldTarget, value
+        };
+
+        treenode = builder.CreateCall(
+            m_inline->m_drti_call_from_profiled, callFromArgs, "treenode");
+    }
+    else if(timed)
+    {
+        llvm::Value* callFromArgs[] = {
+            callsite, caller, oldTarget
+        };
+
+        treenode = builder.CreateCall(
+            m_inline->m_drti_call_from_timed, callFromArgs, "treenode");
+    }
+    else
+    {
+        llvm::Value* callFromArgs[] = {
+            callsite, caller, oldTarget
+        };
+
+        treenode = builder.CreateCall(
+            m_inline->m_drti_call_from, callFromArgs, "treenode");
+    }
 
     // We do two things here - replace the target of the call with
     // the (casted) treenode's resolved_target function pointer and
@@ -665,9 +1056,26 @@ void drti::DecoratePass::decorate_call(
             "_drti_set_caller",
             llvm::Type::getVoidTy(m_module.getContext()),
             treenode->getType()));
+    llvm::Value* timingStart = nullptr;
+    if(timed)
+    {
+        llvm::Value* timingArgs[] = { treenode };
+        timingStart = builder.CreateCall(
+            m_inline->m_drti_timing_start, timingArgs, "timingStart");
+    }
+
     llvm::Value* setCallerArgs[] = { treenode };
     builder.CreateCall(drtiSetCaller, setCallerArgs);
 
+    if(timed)
+    {
+        // Only plain calls are timed (see decorate_calls) so there is
+        // always a next instruction in the same block
+        llvm::IRBuilder<> after(callInst->getNextNode());
+        llvm::Value* timingArgs[] = { treenode, timingStart };
+        after.CreateCall(m_inline->m_drti_timing_end, timingArgs);
+    }
+
     // reset the call target
     callInst->setCalledOperand(newTarget);
 
@@ -681,6 +1089,90 @@ void drti::DecoratePass::decorate_call(
     }
 }
 
+std::vector<llvm::BranchInst*> drti::DecoratePass::collect_branches(
+    llvm::Function* function)
+{
+    std::vector<llvm::BranchInst*> result;
+
+    // As for calls, we number the branches before modifying the
+    // function so the runtime can find them in the saved bitcode
+    if(m_profile_branches)
+    {
+        visit_conditional_branches(
+            *function,
+            [&result](llvm::BranchInst& branch) {
+                result.push_back(&branch);
+            });
+    }
+
+    return result;
+}
+
+llvm::GlobalVariable* drti::DecoratePass::create_branch_counts_global(
+    llvm::Function* function, size_t branches)
+{
+    if(!branches)
+    {
+        return nullptr;
+    }
+
+    llvm::ArrayType* counts_type = llvm::ArrayType::get(
+        llvm::IntegerType::get(m_module.getContext(), 64), 2 * branches);
+
+    return new llvm::GlobalVariable(
+        m_module,
+        counts_type,
+        false, llvm::GlobalValue::InternalLinkage,
+        llvm::ConstantAggregateZero::get(counts_type),
+        "_drti_branch_counts_" + function->getName().str());
+}
+
+void drti::DecoratePass::count_branches(
+    const std::vector<llvm::BranchInst*>& branches,
+    llvm::GlobalVariable* counts)
+{
+    // Before each branch we increment the counter for the edge it is
+    // about to take, without changing the control flow:
+    //
+    //    edge = select i1 condition, 2 * n, 2 * n + 1
+    //    count = counts[edge]
+    //    counts[edge] = count + 1
+    //
+    // The increments aren't atomic, so concurrent threads can lose
+    // counts. That's good enough for branch weights.
+    llvm::IntegerType* int64_type =
+        llvm::IntegerType::get(m_module.getContext(), 64);
+
+    llvm::Constant* zero = llvm::ConstantInt::get(int64_type, 0);
+    llvm::Constant* one = llvm::ConstantInt::get(int64_type, 1);
+
+    for(size_t index = 0; index < branches.size(); ++index)
+    {
+        llvm::BranchInst* branch = branches[index];
+        llvm::IRBuilder<> builder(branch);
+
+        llvm::Value* edge = builder.CreateSelect(
+            branch->getCondition(),
+            llvm::ConstantInt::get(int64_type, 2 * index),
+            llvm::ConstantInt::get(int64_type, 2 * index + 1),
+            "drtiEdge");
+
+        llvm::Value* indexes[] = { zero, edge };
+        llvm::Value* counter = builder.CreateInBoundsGEP(
+            counts, indexes, "drtiEdgeCounter");
+
+        builder.CreateStore(
+            builder.CreateAdd(
+                builder.CreateLoad(counter, "drtiEdgeCount"), one),
+            counter);
+    }
+
+    DEBUG_WITH_TYPE(
+        "drti",
+        llvm::dbgs() << "drti: counting " << branches.size()
+        << " branches with " << counts->getName() << "\n");
+}
+
 std::vector<std::pair<unsigned, llvm::CallBase*>> drti::DecoratePass::collect_calls(
     llvm::Function* function)
 {
@@ -719,7 +1211,12 @@ std::vector<std::pair<unsigned, llvm::CallBase*>> drti::DecoratePass::collect_ca
                         std::string("pointer"))
                     << "\n");
 
-                if(m_target_function_types.find(type) != m_target_function_types.end())
+                // Calls via a std::function's _M_invoker pointer are
+                // decorated even if this module has no invoker of the
+                // same type, since the std::function could have been
+                // created anywhere
+                if((m_target_function_types.find(type) != m_target_function_types.end()) ||
+                   (m_std_function && !global && is_std_function_invoker_type(type)))
                 {
                     if(global && (m_target_functions.find(global) == m_target_functions.end()))
                     {
@@ -766,13 +1263,27 @@ void drti::DecoratePass::decorate_calls(
 
     for(const auto& [call_number, callInst]: collected)
     {
+        llvm::Function* function = callInst->getParent()->getParent();
+        const bool profile_arguments =
+            m_profile_function_names.find(function->getName().str()) !=
+            m_profile_function_names.end();
+        // Profiled call sites already defer compilation on their own
+        // terms. Timing an invoke would need the start value in its
+        // normal destination, which it doesn't necessarily dominate.
+        const bool timed =
+            m_time_calls && !profile_arguments &&
+            llvm::isa<llvm::CallInst>(callInst);
+
         llvm::GlobalVariable* callsite_global(
             create_callsite_global(
-                callInst->getParent()->getParent(),
+                function,
                 landing_global,
-                call_number));
+                call_number,
+                llvm::isa<llvm::Function>(callInst->getCalledOperand()),
+                timed));
 
-        decorate_call(caller, callInst, callsite_global);
+        decorate_call(
+            caller, callInst, callsite_global, profile_arguments, timed);
     }
 }
 
@@ -788,13 +1299,29 @@ void drti::DecoratePass::add_landing_globals()
             // modifying the function
             std::vector<std::pair<unsigned, llvm::CallBase*>> calls(
                 collect_calls(function));
+            std::vector<llvm::BranchInst*> branches(
+                collect_branches(function));
 
-            llvm::GlobalVariable* landing_global = create_landing_global(function);
+            llvm::GlobalVariable* branch_counts =
+                create_branch_counts_global(function, branches.size());
+
+            llvm::GlobalVariable* landing_global = create_landing_global(
+                function, branch_counts, branches.size());
 
             llvm::Value* caller = add_landing_update(function, landing_global);
 
+            if(m_patchable_entry)
+            {
+                add_patchable_entry(function);
+            }
+
             decorate_calls(calls, caller, landing_global);
 
+            if(branch_counts)
+            {
+                count_branches(branches, branch_counts);
+            }
+
             // prints to dbgs()
             llvm::FunctionAnalysisManager DummyFAM;
             llvm::PrintFunctionPass().run(*function, DummyFAM);
@@ -802,8 +1329,32 @@ void drti::DecoratePass::add_landing_globals()
     }
 }
 
+void drti::DecoratePass::add_registration()
+{
+    // This goes in after create_self so it isn't part of the bitcode
+    // we reflect
+    llvm::LLVMContext& context(m_module.getContext());
+
+    llvm::Function* constructor = llvm::Function::Create(
+        llvm::FunctionType::get(llvm::Type::getVoidTy(context), false),
+        llvm::GlobalValue::InternalLinkage,
+        "__drti_register_self",
+        &m_module);
+
+    llvm::IRBuilder<> builder(
+        llvm::BasicBlock::Create(context, "entry", constructor));
+
+    llvm::Value* args[] = { m_reflect_global };
+    builder.CreateCall(m_inline->m_drti_register_module, args);
+    builder.CreateRetVoid();
+
+    llvm::appendToGlobalCtors(m_module, constructor, 65535);
+}
+
 llvm::GlobalVariable* drti::DecoratePass::create_landing_global(
-    llvm::Function* const function)
+    llvm::Function* const function,
+    llvm::GlobalVariable* branch_counts,
+    size_t branches)
 {
     std::string variableName = "_drti_landing_" + function->getName().str();
 
@@ -844,7 +1395,28 @@ llvm::GlobalVariable* drti::DecoratePass::create_landing_global(
             function_name_global,
             llvm::IntegerType::get(m_module.getContext(), 8)->getPointerTo()),
         // self
-        m_reflect_global
+        m_reflect_global,
+        // patchable_entry
+        m_patchable_entry ?
+            llvm::ConstantExpr::getBitCast(
+                function,
+                llvm::IntegerType::get(m_module.getContext(), 8)->getPointerTo()) :
+            llvm::ConstantPointerNull::get(
+                llvm::IntegerType::get(m_module.getContext(), 8)->getPointerTo()),
+        // branch_counts (cast to remove the array type)
+        branch_counts ?
+            llvm::ConstantExpr::getBitCast(
+                branch_counts,
+                llvm::IntegerType::get(m_module.getContext(), 64)->getPointerTo()) :
+            llvm::ConstantPointerNull::get(
+                llvm::IntegerType::get(m_module.getContext(), 64)->getPointerTo()),
+        // branches
+        llvm::ConstantInt::get(
+            llvm::IntegerType::get(m_module.getContext(), 64), branches),
+        // entry
+        llvm::ConstantExpr::getBitCast(
+            function,
+            llvm::IntegerType::get(m_module.getContext(), 8)->getPointerTo())
     };
 
     llvm::Constant* landing_site_constant =
@@ -864,13 +1436,16 @@ llvm::GlobalVariable* drti::DecoratePass::create_landing_global(
 llvm::GlobalVariable* drti::DecoratePass::create_callsite_global(
     llvm::Function* const function,
     llvm::GlobalVariable* landing_global,
-    unsigned call_number)
+    unsigned call_number,
+    bool fixed_target,
+    bool timed)
 {
     llvm::Constant* zero =
         llvm::ConstantInt::get(
             llvm::IntegerType::get(m_module.getContext(), 64), 0);
 
     static_assert(sizeof(unsigned) == 4, "32-bit integer unsigned representation expected");
+    static_assert(sizeof(bool) == 1, "8-bit bool representation expected");
     llvm::Constant* callsite_members[] = {
         // total_calls
         zero,
@@ -880,7 +1455,16 @@ llvm::GlobalVariable* drti::DecoratePass::create_callsite_global(
             llvm::IntegerType::get(m_module.getContext(), 32), call_number),
         // vector
         llvm::ConstantAggregateZero::get(
-            m_inline->m_drti_callsite_type->getElementType(3))
+            m_inline->m_drti_callsite_type->getElementType(3)),
+        // fixed_target
+        llvm::ConstantInt::get(
+            llvm::IntegerType::get(m_module.getContext(), 8), fixed_target),
+        // timed
+        llvm::ConstantInt::get(
+            llvm::IntegerType::get(m_module.getContext(), 8), timed),
+        // return_address
+        llvm::ConstantPointerNull::get(
+            llvm::IntegerType::get(m_module.getContext(), 8)->getPointerTo())
     };
 
     llvm::Constant* callsite_constant =
@@ -930,6 +1514,8 @@ bool drti::Decorate::runOnModule(llvm::Module& module)
     decorator.create_self();
 
     decorator.add_landing_globals();
+
+    decorator.add_registration();
 //    decorator.set_initializers();
 
     // This lets our machine code passes run on the module as well
@@ -29,11 +29,16 @@
 // Get type definitions
 #include <drti/runtime.hpp>
 
+#include <x86intrin.h>
+
 // We put the inlinable functions in the global namespace with C
 // linkage just to avoid the complication of using C++ name mangling
 // to access them from drti-decorate
 #define DRTI_INLINE_SUPPORT extern "C" inline __attribute__((always_inline, used))
 #define DRTI_INTRINSIC extern "C"
+// Out-of-line code for the unusual cases, kept away from the hot text
+#define DRTI_COLD_SUPPORT extern "C" inline \
+    __attribute__((noinline, cold, used, section(".text.unlikely")))
 using namespace drti;
 
 #define DRTI_LIKELY( COND ) \
@@ -93,11 +98,116 @@ DRTI_INLINE_SUPPORT treenode* _drti_call_from(
     DRTI_ATOMIC_INC(site.total_calls);
     // Here we allow null callers for the creation of tree roots
     treenode& node(*_drti_lookup_or_insert(site, caller, target));
-    DRTI_ATOMIC_INC(node.chain_calls);
+
+    if(DRTI_UNLIKELY(
+           DRTI_ATOMIC_INC(node.chain_calls) + 1 == hot_chain_calls))
+    {
+        if(node.landing)
+        {
+            hot_treenode(&node);
+        }
+    }
+
     return &node;
 }
 
-DRTI_INLINE_SUPPORT void _drti_landed(landing_site& site, treenode* caller)
+DRTI_INLINE_SUPPORT treenode* _drti_call_from_timed(
+    static_callsite& site, treenode* caller, const void* target)
+{
+    // As _drti_call_from, but the chain gets hot from the time spent
+    // in it (see _drti_timing_end) rather than the number of calls
+    DRTI_ATOMIC_INC(site.total_calls);
+    treenode* node = _drti_lookup_or_insert(site, caller, target);
+    DRTI_ATOMIC_INC(node->chain_calls);
+    return node;
+}
+
+DRTI_INLINE_SUPPORT uint64_t _drti_timing_start(treenode* node)
+{
+    // Not the first call, which is likely to be unusually slow
+    if(DRTI_UNLIKELY(node->chain_calls % timing_interval == 0))
+    {
+        return __rdtsc();
+    }
+    return 0;
+}
+
+DRTI_COLD_SUPPORT void _drti_timed_call(treenode* node, uint64_t start)
+{
+    int64_t cycles = (__rdtsc() - start) * timing_interval;
+    int64_t before = atomic_fetch_add(&node->chain_cycles, cycles);
+
+    if((before < hot_chain_cycles) &&
+       (before + cycles >= hot_chain_cycles) &&
+       node->landing)
+    {
+        // Either compiles the chain or, if that doesn't happen,
+        // retargets the call for the host (hot_treenode does nothing
+        // once the chain has replaced the caller)
+        inspect_treenode(node);
+        hot_treenode(node);
+    }
+}
+
+DRTI_INLINE_SUPPORT void _drti_timing_end(treenode* node, uint64_t start)
+{
+    if(DRTI_UNLIKELY(start))
+    {
+        _drti_timed_call(node, start);
+    }
+}
+
+DRTI_INLINE_SUPPORT void _drti_record_value(
+    value_profile& profile, int64_t value)
+{
+    // Two threads can race to claim the same empty slot, in which
+    // case one of the values gets miscounted. That's good enough for
+    // profiling purposes.
+    for(int slot = 0; slot < value_profile::slots; ++slot)
+    {
+        if(!profile.counts[slot])
+        {
+            profile.values[slot] = value;
+            DRTI_ATOMIC_INC(profile.counts[slot]);
+            return;
+        }
+        else if(profile.values[slot] == value)
+        {
+            DRTI_ATOMIC_INC(profile.counts[slot]);
+            return;
+        }
+    }
+
+    DRTI_ATOMIC_INC(profile.others);
+}
+
+DRTI_INLINE_SUPPORT treenode* _drti_call_from_profiled(
+    static_callsite& site, treenode* caller, const void* target, int64_t value)
+{
+    treenode* node = _drti_call_from(site, caller, target);
+    _drti_record_value(node->profile, value);
+
+    // The runtime defers compiling profiled chains until they have
+    // enough samples, so let it know when we get there.
+    if(DRTI_UNLIKELY(
+           DRTI_ATOMIC_INC(node->profile.samples) + 1 == value_profile_samples))
+    {
+        if(node->landing)
+        {
+            inspect_treenode(node);
+        }
+    }
+
+    return node;
+}
+
+DRTI_INLINE_SUPPORT void _drti_register_module(reflect* self)
+{
+    register_module(self);
+}
+
+DRTI_INLINE_SUPPORT void _drti_landed(
+    landing_site& site, treenode* caller, const void* return_address)
 {
     DRTI_ATOMIC_INC(site.total_called);
 
@@ -115,7 +225,31 @@ DRTI_INLINE_SUPPORT void _drti_landed(landing_site& site, treenode* caller)
             assert(caller->caller_abi_version == abi_version);
             // TODO - detect landing after jumps from tail-optimized calls
             caller->landing = &site;
+            // Every landing via this callsite has the same return
+            // address so we don't care which thread stores it
+            caller->location.return_address = return_address;
             inspect_treenode(caller);
         }
     }
 }
+
+DRTI_COLD_SUPPORT treenode* _drti_landing_slow_path(
+    landing_site& site, treenode* caller, const void* return_address)
+{
+    // The landing prologue only gets here for an aligned return
+    // address (see add_landing_update in drti-decorate.cpp), and a
+    // decorated call site also has the magic number in front of it
+    const uint64_t* stash =
+        static_cast<const uint64_t*>(return_address) -
+        DRTI_RETALIGN / sizeof(uint64_t);
+
+    if(*stash != DRTI_MAGIC)
+    {
+        // The caller register is meaningless in this case
+        return nullptr;
+    }
+
+    _drti_landed(site, caller, return_address);
+
+    return caller;
+}
@@ -696,15 +696,23 @@ void drti::X86DrtiTreenodePass::insertInlineAsm(
         std::string unique_part(
             preCallSymbol->getName().data() + std::size(preName) - 1);
 
+        // The patch area following the stash is never executed
+        // unless the runtime redirects the initial JMP into it (see
+        // patch_call in drti/patching.cpp) so it starts out as int3
         std::ostringstream inlineAsm;
         inlineAsm
+            << "L_DRTI_JUMP_" << unique_part << ":\n\t"
             << "JMP " << preCallSymbol->getName().data() << "\n\t"
             << ".align " << DRTI_RETALIGN << "\n\t"
             << "L_DRTI_STASH_" << unique_part << ":\n\t"
             << ".8byte " << DRTI_MAGIC << "\n\t"
             << "L_DRTI_STASH_END_" << unique_part << ":\n\t"
+            << ".byte L_DRTI_STASH_" << unique_part
+            << " - L_DRTI_JUMP_" << unique_part << "\n\t"
+            << ".skip " << DRTI_PATCH_BYTES << " - 1, 0xcc\n\t"
             << ".skip "
             << DRTI_RETALIGN << " - " << DRTI_STASH_BYTES
+            << " - " << DRTI_PATCH_BYTES
             << " - (" << postCallSymbol->getName().data() << " - "
             << preCallSymbol->getName().data() << "), 0x90\n\t";
 
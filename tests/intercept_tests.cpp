@@ -23,6 +23,7 @@
 // History
 // =======
 // 2020/08/17   rmg     File creation
+// 2020/09/22   rmg     Stub the other runtime entry points
 //
 
 #include <drti/runtime.hpp>
@@ -37,6 +38,8 @@ static std::vector<drti::treenode*> s_inspected;
 namespace drti
 {
     void inspect_treenode(treenode*);
+    void hot_treenode(treenode*);
+    void register_module(reflect*);
 }
 
 void drti::inspect_treenode(treenode* node)
@@ -46,6 +49,18 @@ void drti::inspect_treenode(treenode* node)
     s_inspected.push_back(node);
 }
 
+// This program doesn't link the runtime, so it also provides the
+// other entry points that the inline support functions call. They
+// have nothing to do here.
+
+void drti::hot_treenode(treenode*)
+{
+}
+
+void drti::register_module(reflect*)
+{
+}
+
 //! Call a leaf function for the call tree
 __attribute__((noinline)) void call_leaf()
 {
@@ -25,17 +25,31 @@
 // =======
 // 2020/04/10   rmg     File creation
 // 2020/08/17   rmg     Renamed from test_main.cpp to raw_tests.cpp
+// 2020/09/24   rmg     Add threaded test14
+// 2020/09/24   rmg     Add test15 for landing_total
+// 2020/09/24   rmg     Add test16 for timed call sites
+// 2020/09/25   rmg     Add test17 for branch weights
+// 2020/09/25   rmg     Add test18 for the inline check
 //
 
 #include <iostream>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <x86intrin.h>
 
 #include "test_support.hpp"
 #include "test_class.hpp"
 
+#include <drti/configuration.hpp>
+#include <drti/runtime.hpp>
+
 using test_function_type1 = const void* (*)();
 
-enum class result_type { pass, fail, known_bug };
+enum class result_type { pass, fail, known_bug, skipped };
 
 // This prevents inlining during ahead-of-time compilation. We need a
 // chain of at least two decorated and not inlined calls in order to
@@ -224,11 +238,599 @@ NOT_INLINED static result_type test5()
     return result_type::fail;
 }
 
+NOT_INLINED static bool test6(const void*& last_result)
+{
+    const void* next_result = test_target2();
+
+    if(!last_result)
+    {
+        last_result = next_result;
+    }
+
+    return next_result != last_result;
+}
+
+NOT_INLINED static result_type test6()
+{
+    // Like test1 except that our caller (this function) is not
+    // decorated so the only way the recompiled version of test6 can
+    // be reached is via entry point patching
+    if(!getenv("DRTI_ENTRY_PATCHING"))
+    {
+        std::cout << "test6 skipped: DRTI_ENTRY_PATCHING not set\n";
+        return result_type::skipped;
+    }
+
+    const void* last_result = nullptr;
+
+    for(int count = 0; count < 1000; ++count)
+    {
+        if(test6(last_result))
+        {
+            // Success!
+            std::cout << "test6 passed\n";
+            return result_type::pass;
+        }
+    }
+    std::cout << "test6 failed: return value never changed\n";
+    return result_type::fail;
+}
+
+NOT_INLINED static bool test7(const void*& last_result, int scale)
+{
+    const void* next_result = test_target5(scale);
+
+    if(!last_result)
+    {
+        last_result = next_result;
+    }
+
+    return next_result != last_result;
+}
+
+NOT_INLINED static result_type test7()
+{
+    // Like test1 except the call from test7(last_result, scale) is
+    // decorated with argument value profiling (DRTI_PROFILE_ARGUMENTS)
+    // so compilation is deferred until enough values are recorded
+    const void* last_result = nullptr;
+    const int scale = 3;
+
+    for(int count = 0; count < 2000; ++count)
+    {
+        if(test7(last_result, scale))
+        {
+            assert(drti_test::get_counter("test_target5") == (count + 1) * scale);
+            // Not before drti::value_profile_samples calls
+            assert(count >= 1000);
+            // Via the specialised clone of test_target5
+            if(!drti_test::get_counter("test_target5_specialised"))
+            {
+                std::cout << "test7 failed: scale not constant-folded\n";
+                return result_type::fail;
+            }
+            // Success!
+            std::cout << "test7 passed\n";
+            return result_type::pass;
+        }
+    }
+    std::cout << "test7 failed: return value never changed\n";
+    return result_type::fail;
+}
+
+// Invocation via std::function
+NOT_INLINED static bool invoke_function(
+    const std::function<const void*()>& target, const void*& last_result)
+{
+    // The call goes via the std::function's _M_invoker pointer to a
+    // library thunk that calls the lambda
+    const void* next_result = target();
+
+    if(!last_result)
+    {
+        last_result = next_result;
+    }
+
+    return next_result != last_result;
+}
+
+NOT_INLINED static result_type test8()
+{
+    // Like test2 but inlining through std::function
+    const std::function<const void*()> target(test_target6());
+    const void* last_result = nullptr;
+
+    for(int count = 0; count < 1000; ++count)
+    {
+        if(invoke_function(target, last_result))
+        {
+            assert(drti_test::get_counter("test_target6") == count + 1);
+            // Success!
+            std::cout << "test8 passed\n";
+            return result_type::pass;
+        }
+    }
+    std::cout << "test8 failed: return value never changed\n";
+    return result_type::fail;
+}
+
+NOT_INLINED static bool test9(const void*& last_result)
+{
+    const void* next_result = test_target7();
+
+    if(!last_result)
+    {
+        last_result = next_result;
+    }
+
+    return next_result != last_result;
+}
+
+NOT_INLINED static result_type test9()
+{
+    // Like test1 except that the result comes from a helper in a
+    // third module, which only gets inlined if the runtime links
+    // that module as well (DRTI_LINK_MODULES)
+    const void* last_result = nullptr;
+
+    for(int count = 0; count < 1000; ++count)
+    {
+        if(test9(last_result))
+        {
+            assert(drti_test::get_counter("test_target7") == count + 1);
+            // Success!
+            std::cout << "test9 passed\n";
+            return result_type::pass;
+        }
+    }
+    std::cout << "test9 failed: return value never changed\n";
+    return result_type::fail;
+}
+
+NOT_INLINED static const void* local_target()
+{
+    return drti_test::instruction_pointer();
+}
+
+NOT_INLINED static bool test10(const void*& last_result)
+{
+    const void* next_result = local_target();
+
+    if(!last_result)
+    {
+        last_result = next_result;
+    }
+
+    return next_result != last_result;
+}
+
+NOT_INLINED static result_type test10()
+{
+    // Like test1 except that the whole chain is in this module, so
+    // the runtime compiles it without linking a second copy
+    const void* last_result = nullptr;
+
+    for(int count = 0; count < 1000; ++count)
+    {
+        if(test10(last_result))
+        {
+            // Success!
+            std::cout << "test10 passed\n";
+            return result_type::pass;
+        }
+    }
+    std::cout << "test10 failed: return value never changed\n";
+    return result_type::fail;
+}
+
+NOT_INLINED static bool test11(const void*& last_result)
+{
+    const void* next_result = test_target2();
+
+    if(!last_result)
+    {
+        last_result = next_result;
+    }
+
+    return next_result != last_result;
+}
+
+NOT_INLINED static result_type test11()
+{
+    // Like test6 except that with DRTI_HOST_ISA the hot call to
+    // test_target2 switches to a copy recompiled for the host CPU,
+    // which needs neither inlining nor entry point patching
+    if(!getenv("DRTI_HOST_ISA") || getenv("DRTI_ENTRY_PATCHING"))
+    {
+        std::cout << "test11 skipped: needs DRTI_HOST_ISA only\n";
+        return result_type::skipped;
+    }
+
+    const void* last_result = nullptr;
+
+    for(int count = 0; count < 2 * drti::hot_chain_calls; ++count)
+    {
+        if(test11(last_result))
+        {
+            // Not before the chain got hot
+            assert(count >= drti::hot_chain_calls - 1);
+            // Success!
+            std::cout << "test11 passed\n";
+            return result_type::pass;
+        }
+    }
+    std::cout << "test11 failed: return value never changed\n";
+    return result_type::fail;
+}
+
+// Virtual call via a secondary base class
+NOT_INLINED static bool invoke_secondary(
+    drti_test::secondary& object, const void*& last_result)
+{
+    const void* next_result = object.secondary_function();
+
+    // Null if the this pointer was adjusted wrongly
+    assert(next_result);
+
+    if(!last_result)
+    {
+        last_result = next_result;
+    }
+
+    return next_result != last_result;
+}
+
+NOT_INLINED static result_type test12()
+{
+    // Like test5 except that the call goes to a this-adjusting thunk,
+    // which the runtime must see through to inline the real function
+    std::unique_ptr<drti_test::secondary> object(
+        drti_test::secondary::create());
+
+    const void* last_result = nullptr;
+
+    for(int count = 0; count < 1000; ++count)
+    {
+        if(invoke_secondary(*object, last_result))
+        {
+            // Success!
+            std::cout << "test12 passed\n";
+            return result_type::pass;
+        }
+    }
+    std::cout << "test12 failed: return value never changed\n";
+    return result_type::fail;
+}
+
+//! The address of test_shared_target's PLT stub in this executable,
+//! which is what a non-PIE executable uses as the function's address
+static const void* shared_target_plt()
+{
+    const void* result = nullptr;
+    asm("leaq _Z18test_shared_targetv@PLT(%%rip), %0" : "=r" (result));
+    return result;
+}
+
+NOT_INLINED static const void* invoke_shared(test_function_type1 target)
+{
+    return target();
+}
+
+NOT_INLINED static result_type test13()
+{
+    // Like test2 except that the leaf is in a shared library and the
+    // call goes via its PLT stub. The guard on the inlined call must
+    // accept the real address as well, which goes via the same call
+    // site once the inlined version is in place.
+    const test_function_type1 stub =
+        reinterpret_cast<test_function_type1>(shared_target_plt());
+    const test_function_type1 real = &test_shared_target;
+
+    if(stub == real)
+    {
+        std::cout << "test13 skipped: no PLT stub\n";
+        return result_type::skipped;
+    }
+
+    const void* original = nullptr;
+    const void* inlined = nullptr;
+    test_function_type1 target = stub;
+
+    for(int count = 0; count < 1000; ++count)
+    {
+        const void* next_result = invoke_shared(target);
+
+        if(!original)
+        {
+            original = next_result;
+        }
+        else if(inlined)
+        {
+            if(next_result != inlined)
+            {
+                std::cout << "test13 failed: real address not inlined\n";
+                return result_type::fail;
+            }
+            // Success!
+            std::cout << "test13 passed\n";
+            return result_type::pass;
+        }
+        else if(next_result != original)
+        {
+            inlined = next_result;
+            target = real;
+        }
+    }
+    std::cout << "test13 failed: return value never changed\n";
+    return result_type::fail;
+}
+
+//! What one thread of test14 saw from its chain
+struct thread_outcome
+{
+    const void* original = nullptr;
+    const void* compiled = nullptr;
+    bool recompiled = false;
+
+    void observe(const void* next_result)
+    {
+        if(!original)
+        {
+            original = next_result;
+        }
+        else if(!compiled)
+        {
+            if(next_result != original)
+            {
+                compiled = next_result;
+            }
+        }
+        else if(next_result != compiled)
+        {
+            recompiled = true;
+        }
+    }
+};
+
+// Each thread has its own caller, since two threads can't safely add
+// treenodes to the same call site at the same time
+NOT_INLINED static const void* test14_chain1()
+{
+    return test_target8();
+}
+
+NOT_INLINED static const void* test14_chain2()
+{
+    return test_target8();
+}
+
+NOT_INLINED static void test14_thread1(
+    const std::atomic<bool>& start, thread_outcome& outcome)
+{
+    while(!start)
+    {
+    }
+
+    for(int count = 0; count < 1000; ++count)
+    {
+        outcome.observe(test14_chain1());
+    }
+}
+
+NOT_INLINED static void test14_thread2(
+    const std::atomic<bool>& start, thread_outcome& outcome)
+{
+    while(!start)
+    {
+    }
+
+    for(int count = 0; count < 1000; ++count)
+    {
+        outcome.observe(test14_chain2());
+    }
+}
+
+NOT_INLINED static result_type test14()
+{
+    // Like test1 but with two threads landing in test_target8 at the
+    // same time, so their chains compile in parallel. Each thread
+    // must reach its compiled chain, which then stays in place.
+    std::atomic<bool> start(false);
+    thread_outcome outcome1;
+    thread_outcome outcome2;
+
+    std::thread thread1(
+        test14_thread1, std::cref(start), std::ref(outcome1));
+    std::thread thread2(
+        test14_thread2, std::cref(start), std::ref(outcome2));
+
+    start = true;
+    thread1.join();
+    thread2.join();
+
+    if(!outcome1.compiled || !outcome2.compiled)
+    {
+        std::cout << "test14 failed: return value never changed\n";
+        return result_type::fail;
+    }
+
+    if(outcome1.recompiled || outcome2.recompiled)
+    {
+        std::cout << "test14 failed: chain compiled more than once\n";
+        return result_type::fail;
+    }
+
+    // Success!
+    std::cout << "test14 passed\n";
+    return result_type::pass;
+}
+
+NOT_INLINED static result_type test15()
+{
+    // By now test1 has compiled a chain with test_target1 inlined,
+    // so calls to it from there skip its landing prologue. The
+    // landing total must still count them, like the test counter,
+    // via the chain's entry counter since test1 calls it once per
+    // entry.
+    const drti::landing_site* landing =
+        drti::counted_landing_site("_Z12test_target1v");
+
+    if(!landing)
+    {
+        std::cout << "test15 failed: no compiled code counts test_target1\n";
+        return result_type::fail;
+    }
+
+    const int64_t total_before = drti::landing_total(*landing);
+    const unsigned count_before = drti_test::get_counter("test_target1");
+    const void* last_result = nullptr;
+
+    for(int count = 0; count < 1000; ++count)
+    {
+        test1(last_result);
+    }
+
+    const int64_t total_added = drti::landing_total(*landing) - total_before;
+    const unsigned count_added =
+        drti_test::get_counter("test_target1") - count_before;
+
+    if(count_added != 1000 || total_added != count_added)
+    {
+        std::cout
+            << "test15 failed: landing total went up by "
+            << total_added
+            << " for "
+            << count_added
+            << " calls\n";
+        return result_type::fail;
+    }
+
+    // Success!
+    std::cout << "test15 passed\n";
+    return result_type::pass;
+}
+
+NOT_INLINED static result_type test16()
+{
+    // Like test1 except that the call from test_timed_call is
+    // decorated with DRTI_TIME_CALLS, so its chain only compiles once
+    // the time spent in it reaches hot_chain_cycles. We time the
+    // calls as well, leaving out the slowest (the one that compiled).
+    const int spins = 10000;
+    const void* original = nullptr;
+    uint64_t cycles = 0;
+    uint64_t slowest = 0;
+
+    for(int count = 0; count < drti::hot_chain_calls; ++count)
+    {
+        const uint64_t start = __rdtsc();
+        const void* next_result = test_timed_call(spins);
+        const uint64_t elapsed = __rdtsc() - start;
+
+        cycles += elapsed;
+        slowest = std::max(slowest, elapsed);
+
+        if(!original)
+        {
+            original = next_result;
+        }
+        else if(next_result != original)
+        {
+            // The runtime's estimate only samples one call in every
+            // timing_interval, so allow it some error
+            if(cycles - slowest < drti::hot_chain_cycles / 2)
+            {
+                std::cout
+                    << "test16 failed: compiled after "
+                    << (count + 1)
+                    << " calls taking "
+                    << (cycles - slowest)
+                    << " cycles\n";
+                return result_type::fail;
+            }
+            // Success!
+            std::cout << "test16 passed\n";
+            return result_type::pass;
+        }
+    }
+    std::cout << "test16 failed: return value never changed\n";
+    return result_type::fail;
+}
+
+NOT_INLINED static result_type test17()
+{
+    // In a build decorated with DRTI_PROFILE_BRANCHES, test7's
+    // caller has a branch that was taken before its chain compiled
+    // (see test7), so the compiled code must have some weights
+    if(!getenv("DRTI_EXPECT_BRANCH_WEIGHTS"))
+    {
+        std::cout << "test17 skipped: DRTI_EXPECT_BRANCH_WEIGHTS not set\n";
+        return result_type::skipped;
+    }
+
+    if(!drti::weighted_branches())
+    {
+        std::cout << "test17 failed: no branch weights applied\n";
+        return result_type::fail;
+    }
+
+    // Success!
+    std::cout << "test17 passed\n";
+    return result_type::pass;
+}
+
+NOT_INLINED static bool test18(const void*& last_result)
+{
+    const void* next_result = test_target10();
+
+    if(!last_result)
+    {
+        last_result = next_result;
+    }
+
+    return next_result != last_result;
+}
+
+NOT_INLINED static result_type test18()
+{
+    // Like test1 except that test_target10 costs too much to inline,
+    // so the chain only compiles with DRTI_INLINE_CHECK=0
+    const char* check = getenv("DRTI_INLINE_CHECK");
+    const bool expect_compiled = check && !std::strcmp(check, "0");
+    const void* last_result = nullptr;
+
+    for(int count = 0; count < 1000; ++count)
+    {
+        if(test18(last_result))
+        {
+            if(!expect_compiled)
+            {
+                std::cout << "test18 failed: chain compiled despite its cost\n";
+                return result_type::fail;
+            }
+            // Success!
+            std::cout << "test18 passed\n";
+            return result_type::pass;
+        }
+    }
+
+    if(expect_compiled)
+    {
+        std::cout << "test18 failed: return value never changed\n";
+        return result_type::fail;
+    }
+
+    // Success!
+    std::cout << "test18 passed\n";
+    return result_type::pass;
+}
+
 bool all_passed(int external_data)
 {
     int tried = 0;
     int passed = 0;
     int known_bug = 0;
+    int skipped = 0;
 
     auto check = [&](result_type result) {
         ++tried;
@@ -242,6 +844,10 @@ bool all_passed(int external_data)
                 ++known_bug;
                 break;
 
+            case result_type::skipped:
+                ++skipped;
+                break;
+
             case result_type::fail:
                 break;
         }
@@ -252,15 +858,29 @@ bool all_passed(int external_data)
     check(test3(external_data));
     check(test4());
     check(test5());
+    check(test6());
+    check(test7());
+    check(test8());
+    check(test9());
+    check(test10());
+    check(test11());
+    check(test12());
+    check(test13());
+    check(test14());
+    check(test15());
+    check(test16());
+    check(test17());
+    check(test18());
 
     std::cout
         << "Ran "
         << tried << " raw tests, "
         << passed << " passed, "
         << known_bug << " known bug(s), "
-        << (tried - passed - known_bug) << " failed\n";
+        << skipped << " skipped, "
+        << (tried - passed - known_bug - skipped) << " failed\n";
 
-    return (passed + known_bug) == tried;
+    return (passed + known_bug + skipped) == tried;
 }
 
 int main(int argc, char *argv[])
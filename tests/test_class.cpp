@@ -32,6 +32,19 @@ namespace drti_test
     {
         const void* virtual_function() const override;
     };
+
+    constexpr int multi_tag = 0x5ec0;
+
+    struct multi_impl : interface, secondary
+    {
+        const void* virtual_function() const override;
+        // Not inlined into its thunk, which must stay a plain jump
+        __attribute__((noinline))
+        const void* secondary_function() const override;
+
+        //! Lets us detect a wrongly adjusted this pointer
+        int m_tag = multi_tag;
+    };
 }
 
 const void* drti_test::impl::virtual_function() const
@@ -44,7 +57,24 @@ std::unique_ptr<drti_test::interface> drti_test::interface::create()
     return std::make_unique<impl>();
 }
 
+const void* drti_test::multi_impl::virtual_function() const
+{
+    return instruction_pointer();
+}
+
+const void* drti_test::multi_impl::secondary_function() const
+{
+    return (m_tag == multi_tag) ? instruction_pointer() : nullptr;
+}
+
+std::unique_ptr<drti_test::secondary> drti_test::secondary::create()
+{
+    return std::make_unique<multi_impl>();
+}
+
 // Support interface->foo() virtual function calls to be inlined
 // against impl->foo(). To avoid having to provide this information
 // manually we'd need some DRTI-specific support in the C++ front-end
 DRTI_CONVERTIBLE(drti_test::interface*, drti_test::impl*);
+// There is deliberately no conversion for secondary* to multi_impl*,
+// since the runtime takes the adjustment from the thunk
@@ -40,10 +40,21 @@ namespace drti_test
         static std::unique_ptr<interface> create();
     };
 
+    //! A second base class, so that virtual calls via it go through
+    //! a this-adjusting thunk
+    struct secondary
+    {
+        virtual ~secondary() = default;
+        virtual const void* secondary_function() const = 0;
+
+        static std::unique_ptr<secondary> create();
+    };
+
     //! This is a workaround to allow us to name (via the
     //! drti_test_targets.txt file) the type of the virtual function
     //! calls that we want to inline.
     inline const void* type_matched_function(const interface*);
+    inline const void* type_matched_secondary(const secondary*);
 }
 
 // We never actually call this but we need it to be available by name
@@ -54,4 +65,10 @@ __attribute__((used)) inline const void* drti_test::type_matched_function(
     return nullptr;
 }
 
+__attribute__((used)) inline const void* drti_test::type_matched_secondary(
+    const secondary*)
+{
+    return nullptr;
+}
+
 #endif // test_class_rmg_20200824_included
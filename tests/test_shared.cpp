@@ -0,0 +1,34 @@
+// -*- mode:c++ -*-
+//
+// Module test_shared.cpp
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/22   rmg     File creation
+//
+
+#include "test_support.hpp"
+
+// Built into libtest_shared-drti.so, so the test executable calls it
+// via a PLT stub. It can't use the counters in test_support, which
+// live in the executable.
+const void* test_shared_target()
+{
+    return drti_test::instruction_pointer();
+}
@@ -21,11 +21,18 @@
 // History
 // =======
 // 2020/08/03   rmg     File creation
+// 2020/09/24   rmg     Add test_target8
+// 2020/09/24   rmg     Add test_target9 and test_timed_call
+// 2020/09/25   rmg     Add test_target10
 //
 
 #ifndef test_support_rmg_20200803_included
 #define test_support_rmg_20200803_included
 
+#include <drti/convertible.hpp>
+
+#include <functional>
+
 //! Functions that give us back the address of an arbitrary
 //! instruction in their own machine code.  We use these to confirm
 //! runtime recompilation.
@@ -33,22 +40,20 @@ extern const void* test_target1();
 extern const void* test_target2();
 extern const void* test_target3();
 extern const void* test_target4(bool);
-
-//! Generate a support function to allow DRTI to convert between
-//! (pointer) types at runtime. This is necessary to make virtual
-//! function calls work, since during inlining a call to (e.g.) void
-//! virtual_function(base*) actually resolves to void
-//! virtual_function(derived*). This is really just a workaround; to
-//! make this work properly we would want the C++ front-end to provide
-//! something equivalent to this.
-#define DRTI_CONVERTIBLE(SOURCE_TYPE, TARGET_TYPE)     \
-    __attribute__((used, always_inline)) static inline \
-    TARGET_TYPE __drti_converter(                      \
-        /* Dummy argument makes overloading work */    \
-        SOURCE_TYPE value, TARGET_TYPE /* dummy */)    \
-    {                                                  \
-        return static_cast<TARGET_TYPE>(value);        \
-    }
+extern const void* test_target5(int);
+extern std::function<const void*()> test_target6();
+extern const void* test_target7();
+extern const void* test_helper7();
+//! No counter, so safe to call from more than one thread
+extern const void* test_target8();
+//! Spins for the given number of iterations first
+extern const void* test_target9(int spins);
+//! Calls test_target9 from a timed call site
+extern const void* test_timed_call(int spins);
+//! Too big to be worth inlining
+extern const void* test_target10();
+//! In a shared library
+extern const void* test_shared_target();
 
 namespace drti_test
 {
@@ -0,0 +1,49 @@
+// -*- mode:c++ -*-
+//
+// Module test_target10.cpp
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// DRTI is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+//
+// History
+// =======
+// 2020/09/25   rmg     File creation
+//
+
+#include "test_support.hpp"
+
+static volatile int sink[16];
+
+#define STORE1(n) sink[(n) % 16] = (n);
+#define STORE4(n) STORE1(n) STORE1(n + 1) STORE1(n + 2) STORE1(n + 3)
+#define STORE16(n) STORE4(n) STORE4(n + 4) STORE4(n + 8) STORE4(n + 12)
+#define STORE64(n) STORE16(n) STORE16(n + 16) STORE16(n + 32) STORE16(n + 48)
+#define STORE256(n) \
+    STORE64(n) STORE64(n + 64) STORE64(n + 128) STORE64(n + 192)
+
+// Over a thousand volatile stores, which costs far more to inline
+// than the runtime's inline_threshold, so that test18's chain fails
+// the inline check
+const void* test_target10()
+{
+    STORE256(0)
+    STORE256(256)
+    STORE256(512)
+    STORE256(768)
+
+    return drti_test::instruction_pointer();
+}
@@ -0,0 +1,46 @@
+// -*- mode:c++ -*-
+//
+// Module test_target5.cpp
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/10   rmg     File creation
+//
+
+#include "test_support.hpp"
+
+// The value of scale is profiled at the call site in raw_tests.cpp, so
+// DRTI can inline a copy of this function with scale constant-folded
+const void* test_target5(int scale)
+{
+    static unsigned& counter = drti_test::new_counter("test_target5");
+    static unsigned& specialised =
+        drti_test::new_counter("test_target5_specialised");
+    counter += scale;
+
+    // Clang leaves this to the optimiser (llvm.is.constant), so it's
+    // false ahead of time and only true in the clone with scale
+    // constant-folded
+    if(__builtin_constant_p(scale))
+    {
+        ++specialised;
+    }
+
+    return drti_test::instruction_pointer();
+}
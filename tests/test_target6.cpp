@@ -0,0 +1,39 @@
+// -*- mode:c++ -*-
+//
+// Module test_target6.cpp
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/14   rmg     File creation
+//
+
+#include "test_support.hpp"
+
+// The lambda is only reachable via the std::function's invoker
+// thunk, which drti-decorate recognises without it being listed in
+// drti_test_targets.txt
+std::function<const void*()> test_target6()
+{
+    return []() {
+        static unsigned& counter = drti_test::new_counter("test_target6");
+        ++counter;
+
+        return drti_test::instruction_pointer();
+    };
+}
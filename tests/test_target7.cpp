@@ -0,0 +1,36 @@
+// -*- mode:c++ -*-
+//
+// Module test_target7.cpp
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/16   rmg     File creation
+//
+
+#include "test_support.hpp"
+
+// The helper is in another module, so inlining it at runtime requires
+// linking a third module
+const void* test_target7()
+{
+    static unsigned& counter = drti_test::new_counter("test_target7");
+    ++counter;
+
+    return test_helper7();
+}
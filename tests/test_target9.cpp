@@ -0,0 +1,40 @@
+// -*- mode:c++ -*-
+//
+// Module test_target9.cpp
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// DRTI is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/24   rmg     File creation
+//
+
+#include "test_support.hpp"
+
+// Slow enough that a timed chain gets hot from the time spent in it
+// long before hot_chain_calls, but still cheap to inline
+const void* test_target9(int spins)
+{
+    volatile int sink = 0;
+
+    for(int count = 0; count < spins; ++count)
+    {
+        sink = sink + count;
+    }
+
+    return drti_test::instruction_pointer();
+}
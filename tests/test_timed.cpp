@@ -0,0 +1,33 @@
+// -*- mode:c++ -*-
+//
+// Module test_timed.cpp
+//
+// Copyright (c) 2020 Raoul M. Gough
+//
+// This file is part of DRTI.
+//
+// DRTI is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, version 3 only.
+//
+// DRTI is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// History
+// =======
+// 2020/09/24   rmg     File creation
+//
+
+#include "test_support.hpp"
+
+// Decorated with DRTI_TIME_CALLS (see Makefile) so that this call
+// site's chains are judged by chain_cycles, for test16
+const void* test_timed_call(int spins)
+{
+    return test_target9(spins);
+}